@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#include "ServerHistory.h"
+
+#include <ChimeraTK/ApplicationCore/ScalarAccessor.h>
+#include <ChimeraTK/ApplicationCore/TestFacility.h>
+
+#include <benchmark/benchmark.h>
+
+/**
+ * Module providing the variables fed into the history. On every trigger all outputs are written once.
+ */
+template<typename UserType>
+struct BenchmarkSource : public ChimeraTK::ApplicationModule {
+  BenchmarkSource() = default;
+  BenchmarkSource(ChimeraTK::ModuleGroup* owner, const std::string& name, size_t nVariables, size_t nElements)
+  : ApplicationModule(owner, name, "Source of the benchmarked variables") {
+    for(size_t i = 0; i < nVariables; i++) {
+      outputs.emplace_back(this, "out" + std::to_string(i), "", nElements, "Benchmarked variable",
+          std::unordered_set<std::string>{"history"});
+    }
+  }
+
+  ChimeraTK::ScalarPushInput<uint64_t> trigger{this, "trigger", "", "Trigger writing all outputs"};
+  std::vector<ChimeraTK::ArrayOutput<UserType>> outputs;
+
+  void mainLoop() override {
+    while(true) {
+      auto value = ChimeraTK::userTypeToUserType<UserType>(static_cast<uint64_t>(trigger));
+      for(auto& output : outputs) {
+        std::fill(output.begin(), output.end(), value);
+        output.write();
+      }
+      trigger.read();
+    }
+  }
+};
+
+template<typename UserType>
+struct BenchmarkApp : public ChimeraTK::Application {
+  BenchmarkApp(size_t nVariables, size_t nElements, const ChimeraTK::history::ServerHistoryConfig& config)
+  : Application("benchmark") {
+    source = BenchmarkSource<UserType>{this, "Source", nVariables, nElements};
+    hist = ChimeraTK::history::ServerHistory{this, "history", "History of the benchmarked variables", config};
+  }
+  ~BenchmarkApp() override { shutdown(); }
+
+  BenchmarkSource<UserType> source;
+  ChimeraTK::history::ServerHistory hist;
+};
+
+/**
+ * Configuration of the benchmarked module with the given history length and time stamp setting.
+ */
+static ChimeraTK::history::ServerHistoryConfig benchmarkConfig(size_t historyLength, bool enableTimeStamps) {
+  ChimeraTK::history::ServerHistoryConfig config;
+  config.historyLength = historyLength;
+  config.enableTimeStamps = enableTimeStamps;
+  return config;
+}
+
+/**
+ * Measure the update of the histories with the given configuration. Each iteration updates all variables once. Besides
+ * the history update this includes writing the source variables and the synchronisation of the TestFacility, so the
+ * throughput is most useful to compare different versions or configurations. The processing time inside the module is
+ * reported in addition, taken from the status outputs (see ServerHistoryConfig::enableStatus) of the last iteration.
+ */
+template<typename UserType>
+static void measureUpdates(benchmark::State& state, size_t nVariables, size_t nElements,
+    ChimeraTK::history::ServerHistoryConfig config) {
+  config.enableStatus = true;
+  config.statusInterval = std::chrono::milliseconds(0); // publish the status after each iteration
+  BenchmarkApp<UserType> app(nVariables, nElements, config);
+  ChimeraTK::TestFacility tf(app);
+  auto trigger = tf.getScalar<uint64_t>("Source/trigger");
+  auto processingTimeP50 = tf.getScalar<float>("history/status/processingTimeP50");
+  auto processingTimeP99 = tf.getScalar<float>("history/status/processingTimeP99");
+  tf.runApplication();
+
+  uint64_t counter = 0;
+  for(auto _ : state) {
+    trigger = ++counter;
+    trigger.write();
+    tf.stepApplication();
+  }
+
+  auto nUpdates = static_cast<double>(state.iterations() * nVariables);
+  state.SetItemsProcessed(static_cast<int64_t>(nUpdates));
+  state.counters["timePerUpdate"] =
+      benchmark::Counter(nUpdates, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+  processingTimeP50.readLatest();
+  processingTimeP99.readLatest();
+  state.counters["processingTimeP50_us"] = static_cast<float>(processingTimeP50);
+  state.counters["processingTimeP99_us"] = static_cast<float>(processingTimeP99);
+}
+
+/**
+ * Measure the update of the histories over a sweep of the configuration, see sweepArguments().
+ *
+ * Arguments: number of variables, history length, number of elements, time stamps enabled
+ */
+template<typename UserType>
+static void updateHistory(benchmark::State& state) {
+  measureUpdates<UserType>(state, static_cast<size_t>(state.range(0)), static_cast<size_t>(state.range(2)),
+      benchmarkConfig(static_cast<size_t>(state.range(1)), state.range(3) != 0));
+}
+
+/**
+ * Measure the update of scalar histories with and without the scalar fast path (see HistoryEntry::plainScalar), with
+ * otherwise identical configuration.
+ *
+ * Arguments: number of variables, fast path enabled
+ */
+template<typename UserType>
+static void updateScalarHistory(benchmark::State& state) {
+  auto config = benchmarkConfig(1200, true);
+  config.scalarFastPath = state.range(1) != 0;
+  measureUpdates<UserType>(state, static_cast<size_t>(state.range(0)), 1, config);
+}
+
+/**
+ * Measure the construction and destruction of an application with many variables, which include the model search
+ * and the registration of the histories. The fitted complexity should be linear in the number of variables.
+ *
+ * Arguments: number of variables
+ */
+static void constructApplication(benchmark::State& state) {
+  auto nVariables = static_cast<size_t>(state.range(0));
+  for(auto _ : state) {
+    BenchmarkApp<int32_t> app(nVariables, 4, benchmarkConfig(10, true));
+    benchmark::DoNotOptimize(app.hist.getNumberOfVariables());
+  }
+  state.SetComplexityN(state.range(0));
+}
+
+/**
+ * Sweep over the benchmark arguments, skipping combinations which would need too much memory.
+ */
+static void sweepArguments(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"variables", "length", "elements", "timeStamps"});
+  for(int64_t nVariables : {10, 100, 1000}) {
+    for(int64_t historyLength : {100, 1200}) {
+      for(int64_t nElements : {1, 16, 256}) {
+        if(nVariables * historyLength * nElements > 5000000) continue;
+        for(int64_t timeStamps : {0, 1}) {
+          benchmark->Args({nVariables, historyLength, nElements, timeStamps});
+        }
+      }
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(updateHistory, int32_t)->Apply(sweepArguments)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(updateHistory, double)->Apply(sweepArguments)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(updateHistory, std::string)->Apply(sweepArguments)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(updateScalarHistory, double)
+    ->ArgNames({"variables", "fastPath"})
+    ->ArgsProduct({{100, 1000, 4000}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(constructApplication)
+    ->ArgName("variables")
+    ->RangeMultiplier(2)
+    ->Range(500, 8000)
+    ->Complexity(benchmark::oN)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,151 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace ChimeraTK { namespace history {
+
+  /**
+   * Queue holding the candidates for the minimum (or maximum, depending on Compare) of a sliding window. The values
+   * in the queue are ordered, so the front is the extremum of the window. Each value is added and removed at most
+   * once, which makes updates O(1) amortised. The capacity is fixed, so no memory is allocated after construction.
+   */
+  template<typename T, typename Compare>
+  class MonotonicQueue {
+   public:
+    MonotonicQueue() = default;
+    explicit MonotonicQueue(size_t capacity) : _values(capacity), _numbers(capacity) {}
+
+    /** Add the value of the sample with the given number, which must be larger than all numbers in the queue */
+    void push(uint64_t number, const T& value) {
+      // values which are not better than the new one can never become the extremum
+      while(_size > 0 && !Compare()(_values[index(_size - 1)], value)) --_size;
+      _values[index(_size)] = value;
+      _numbers[index(_size)] = number;
+      ++_size;
+    }
+
+    /** Remove all values of samples with numbers smaller than the given one */
+    void expire(uint64_t firstNumber) {
+      while(_size > 0 && _numbers[_first] < firstNumber) {
+        _first = (_first + 1) % _values.size();
+        --_size;
+      }
+    }
+
+    const T& front() const { return _values[_first]; }
+    bool empty() const { return _size == 0; }
+
+    void clear() {
+      _first = 0;
+      _size = 0;
+    }
+
+   private:
+    size_t index(size_t i) const { return (_first + i) % _values.size(); }
+
+    std::vector<T> _values;
+    std::vector<uint64_t> _numbers;
+    size_t _first{0};
+    size_t _size{0};
+  };
+
+  /**
+   * Statistics of all elements over the samples currently held in a history ring buffer. Adding a sample is O(1) per
+   * element: the sums are updated with the new and the overwritten sample, the extrema are kept in monotonic queues.
+   * To avoid accumulating rounding errors, the sums are recomputed from the ring buffer once per history length.
+   */
+  template<typename UserType>
+  class WindowStatistics {
+   public:
+    WindowStatistics() = default;
+    WindowStatistics(size_t nElements, size_t historyLength)
+    : _sum(nElements), _sumSquares(nElements), _min(nElements, MonotonicQueue<UserType, std::less<>>(historyLength)),
+      _max(nElements, MonotonicQueue<UserType, std::greater<>>(historyLength)), _historyLength(historyLength) {}
+
+    /**
+     * Update element i with the new value. If the window is full (see isFull()), removed is the value of the
+     * overwritten sample. Call nextSample() after updating all elements.
+     */
+    void update(size_t i, const UserType& value, const UserType& removed) {
+      auto v = static_cast<double>(value);
+      _sum[i] += v;
+      _sumSquares[i] += v * v;
+      if(isFull()) {
+        auto r = static_cast<double>(removed);
+        _sum[i] -= r;
+        _sumSquares[i] -= r * r;
+        _min[i].expire(_sampleNumber + 1 - _historyLength);
+        _max[i].expire(_sampleNumber + 1 - _historyLength);
+      }
+      _min[i].push(_sampleNumber, value);
+      _max[i].push(_sampleNumber, value);
+    }
+
+    /** Finish adding a sample. Returns true if the sums should be recomputed, see recompute(). */
+    bool nextSample() {
+      ++_sampleNumber;
+      if(_count < _historyLength) ++_count;
+      return ++_sinceRecompute >= _historyLength;
+    }
+
+    /**
+     * Recompute the sums from the given samples, which must be the samples in the window. The samples are given as
+     * function returning element i of sample k, where k runs over the rows of the ring buffer. The loop is kept
+     * simple so it can be vectorised.
+     */
+    template<typename Sample>
+    void recompute(size_t nSamples, Sample&& sample) {
+      std::fill(_sum.begin(), _sum.end(), 0.);
+      std::fill(_sumSquares.begin(), _sumSquares.end(), 0.);
+      auto nElements = _sum.size();
+      for(size_t k = 0; k < nSamples; k++) {
+        for(size_t i = 0; i < nElements; i++) {
+          auto v = static_cast<double>(sample(k, i));
+          _sum[i] += v;
+          _sumSquares[i] += v * v;
+        }
+      }
+      _sinceRecompute = 0;
+    }
+
+    /** Forget all samples */
+    void clear() {
+      std::fill(_sum.begin(), _sum.end(), 0.);
+      std::fill(_sumSquares.begin(), _sumSquares.end(), 0.);
+      for(auto& queue : _min) queue.clear();
+      for(auto& queue : _max) queue.clear();
+      _count = 0;
+      _sinceRecompute = 0;
+    }
+
+    /** The window holds historyLength samples, so the next sample overwrites one */
+    bool isFull() const { return _count == _historyLength; }
+
+    /** Number of samples in the window */
+    size_t count() const { return _count; }
+
+    double mean(size_t i) const { return _count > 0 ? _sum[i] / static_cast<double>(_count) : 0.; }
+    double rms(size_t i) const {
+      return _count > 0 ? std::sqrt(std::max(_sumSquares[i], 0.) / static_cast<double>(_count)) : 0.;
+    }
+    UserType min(size_t i) const { return _min[i].empty() ? UserType() : _min[i].front(); }
+    UserType max(size_t i) const { return _max[i].empty() ? UserType() : _max[i].front(); }
+
+   private:
+    std::vector<double> _sum;
+    std::vector<double> _sumSquares;
+    std::vector<MonotonicQueue<UserType, std::less<>>> _min;
+    std::vector<MonotonicQueue<UserType, std::greater<>>> _max;
+    size_t _historyLength{0};
+    size_t _count{0};
+    uint64_t _sampleNumber{0};
+    size_t _sinceRecompute{0};
+  };
+
+}} // namespace ChimeraTK::history
@@ -0,0 +1,458 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include <ChimeraTK/SupportedUserTypes.h>
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace ChimeraTK { namespace history {
+
+  /**
+   * Contiguous buffer used as storage of the history ring buffers. The memory is either owned by the buffer or
+   * belongs to a memory mapped file, see PersistentHistoryFile.
+   */
+  template<typename T>
+  class HistoryBuffer {
+   public:
+    HistoryBuffer() = default;
+
+    /** Create a buffer owning its memory */
+    explicit HistoryBuffer(size_t size) : _owned(size), _data(_owned.data()), _size(size) {}
+
+    /** Create a buffer using external memory, which must outlive the buffer */
+    HistoryBuffer(T* data, size_t size) : _data(data), _size(size) {}
+
+    T* begin() { return _data; }
+    T* end() { return _data + _size; }
+    const T* begin() const { return _data; }
+    const T* end() const { return _data + _size; }
+    const T* cbegin() const { return _data; }
+    const T* cend() const { return _data + _size; }
+    T* data() { return _data; }
+    const T* data() const { return _data; }
+    T& operator[](size_t i) { return _data[i]; }
+    const T& operator[](size_t i) const { return _data[i]; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    /** Size of the stored elements in bytes, not including memory allocated by the elements */
+    size_t memorySize() const { return _size * sizeof(T); }
+
+   private:
+    std::vector<T> _owned; // moving the vector keeps the address of its elements, so _data stays valid
+    T* _data{nullptr};
+    size_t _size{0};
+  };
+
+  /** Coding storing the samples unchanged */
+  template<typename UserType>
+  struct NativeCoding {
+    const UserType& encode(const UserType& value) const { return value; }
+    const UserType& decode(const UserType& value) const { return value; }
+  };
+
+  /** Coding storing floating point samples with single precision */
+  template<typename UserType>
+  struct Float32Coding {
+    float encode(UserType value) const { return static_cast<float>(value); }
+    UserType decode(float value) const { return static_cast<UserType>(value); }
+  };
+
+  /** Storage type of the quantised coding, unsigned for unsigned UserTypes to keep the full range */
+  template<typename UserType>
+  using QuantisedType = std::conditional_t<std::is_signed<UserType>::value, int16_t, uint16_t>;
+
+  /**
+   * Coding storing samples as 16 bit multiples of a quantisation step. Values outside of the representable range are
+   * saturated, NaN is stored as 0.
+   */
+  template<typename UserType>
+  struct QuantisedCoding {
+    QuantisedType<UserType> encode(UserType value) const {
+      auto code = std::round(static_cast<double>(value) / step);
+      if(std::isnan(code)) return 0;
+      return static_cast<QuantisedType<UserType>>(
+          std::clamp(code, static_cast<double>(std::numeric_limits<QuantisedType<UserType>>::min()),
+              static_cast<double>(std::numeric_limits<QuantisedType<UserType>>::max())));
+    }
+
+    UserType decode(QuantisedType<UserType> code) const {
+      auto value = static_cast<double>(code) * step;
+      if constexpr(std::is_integral<UserType>::value) value = std::round(value);
+      return static_cast<UserType>(value);
+    }
+
+    double step;
+  };
+
+  /** Convert doubles to floats, using SIMD instructions if available */
+  void convertToFloat(const double* in, float* out, size_t n);
+
+  /** Convert floats to doubles, using SIMD instructions if available */
+  void convertToDouble(const float* in, double* out, size_t n);
+
+  /**
+   * Encode n contiguous values. The generic version encodes value by value, the overloads copy or convert the values
+   * in one pass.
+   */
+  template<typename Coding, typename In, typename Out>
+  void encodeRow(const Coding& coding, const In* in, Out* out, size_t n) {
+    for(size_t i = 0; i < n; i++) out[i] = coding.encode(in[i]);
+  }
+
+  template<typename UserType>
+  void encodeRow(const NativeCoding<UserType>&, const UserType* in, UserType* out, size_t n) {
+    std::copy(in, in + n, out);
+  }
+
+  inline void encodeRow(const Float32Coding<double>&, const double* in, float* out, size_t n) {
+    convertToFloat(in, out, n);
+  }
+
+  /** Decode n contiguous values, see encodeRow() */
+  template<typename Coding, typename In, typename Out>
+  void decodeRow(const Coding& coding, const In* in, Out* out, size_t n) {
+    for(size_t i = 0; i < n; i++) out[i] = coding.decode(in[i]);
+  }
+
+  template<typename UserType>
+  void decodeRow(const NativeCoding<UserType>&, const UserType* in, UserType* out, size_t n) {
+    std::copy(in, in + n, out);
+  }
+
+  inline void decodeRow(const Float32Coding<double>&, const float* in, double* out, size_t n) {
+    convertToDouble(in, out, n);
+  }
+
+  /**
+   * Buffer of strings stored in fixed size slots of one contiguous allocation. Storing a string copies its characters
+   * into the slot, so no memory is allocated after construction. Strings longer than the slot size are truncated.
+   */
+  class StringSlotBuffer {
+   public:
+    /** Reference to one slot, used to assign a new string */
+    class Slot {
+     public:
+      Slot(StringSlotBuffer& buffer, size_t index) : _buffer(buffer), _index(index) {}
+      Slot& operator=(const std::string& value) {
+        _buffer.set(_index, value);
+        return *this;
+      }
+
+     private:
+      StringSlotBuffer& _buffer;
+      size_t _index;
+    };
+
+    StringSlotBuffer() = default;
+    StringSlotBuffer(size_t size, size_t slotSize)
+    : _characters(size * slotSize), _lengths(size), _slotSize(slotSize) {}
+
+    /** Store the string in slot i, truncating it to the slot size */
+    void set(size_t i, const std::string& value) {
+      auto length = std::min(value.size(), _slotSize);
+      std::copy(value.data(), value.data() + length, _characters.data() + i * _slotSize);
+      _lengths[i] = static_cast<uint32_t>(length);
+    }
+
+    Slot operator[](size_t i) { return {*this, i}; }
+    std::string_view operator[](size_t i) const { return {_characters.data() + i * _slotSize, _lengths[i]}; }
+    size_t size() const { return _lengths.size(); }
+    bool empty() const { return _lengths.empty(); }
+    size_t memorySize() const { return _characters.size() + _lengths.size() * sizeof(uint32_t); }
+
+   private:
+    std::vector<char> _characters;
+    std::vector<uint32_t> _lengths;
+    size_t _slotSize{0};
+  };
+
+  /** Coding used with the StringSlotBuffer */
+  struct StringSlotCoding {
+    const std::string& encode(const std::string& value) const { return value; }
+    std::string_view decode(std::string_view value) const { return value; }
+  };
+
+  /**
+   * Ring buffer of time stamps stored as 32 bit offsets to a common 64 bit base. The offset 0 is reserved for the time
+   * stamp 0 of entries not yet filled.
+   * If a time stamp cannot be represented, the base is moved to the oldest time stamp in the buffer. If the buffer
+   * spans more than 2^32-1 units, the oldest time stamps are saturated.
+   */
+  class CompactTimeStampBuffer {
+   public:
+    CompactTimeStampBuffer() = default;
+    explicit CompactTimeStampBuffer(size_t size) : _offsets(size) {}
+
+    /** Store the time stamp at the given index */
+    void set(size_t i, uint64_t timeStamp);
+
+    uint64_t operator[](size_t i) const { return decode(_offsets[i]); }
+
+    /** Time stamp of the given stored offset, used with begin() and end() */
+    uint64_t decode(uint32_t offset) const { return offset == 0 ? 0 : _base + offset - 1; }
+
+    const uint32_t* data() const { return _offsets.data(); }
+    const uint32_t* begin() const { return _offsets.data(); }
+    const uint32_t* end() const { return _offsets.data() + _offsets.size(); }
+    size_t size() const { return _offsets.size(); }
+    bool empty() const { return _offsets.empty(); }
+
+   private:
+    std::vector<uint32_t> _offsets;
+    uint64_t _base{0};
+  };
+
+  /**
+   * Counters of the samples written to a history, used by readers in other threads to detect samples overwritten
+   * while reading. The writer increments started before and finished after writing a sample, like a sequence lock.
+   */
+  struct WriteCounter {
+    WriteCounter() = default;
+    WriteCounter(WriteCounter&& other) noexcept : started(other.started.load()), finished(other.finished.load()) {}
+    WriteCounter& operator=(WriteCounter&& other) noexcept {
+      started = other.started.load();
+      finished = other.finished.load();
+      return *this;
+    }
+
+    std::atomic<uint64_t> started{0};
+    std::atomic<uint64_t> finished{0};
+  };
+
+  /**
+   * Header at the beginning of a persistent history file. It is followed by the data ring buffer and the time stamp
+   * ring buffer (starting at the next 8 byte boundary).
+   */
+  struct PersistentHistoryHeader {
+    char magic[8];            ///< Always "CTKHIST"
+    uint32_t formatVersion;   ///< Version of the file layout, see PersistentHistoryFile::formatVersion
+    uint32_t typeCode;        ///< Identifies the UserType, see persistentTypeCode()
+    uint64_t historyLength;   ///< Number of entries in the ring buffers
+    uint64_t nElements;       ///< Number of elements per entry of the data ring buffer
+    uint64_t timeStampLength; ///< Number of entries in the time stamp ring buffer, 0 without time stamps
+    uint64_t cursor;          ///< Ring index the next sample is written to
+    uint64_t nSamples;        ///< Number of filled entries, i.e. the newest nSamples entries before the cursor
+    uint64_t reserved;
+  };
+  static_assert(sizeof(PersistentHistoryHeader) == 64, "Unexpected padding in PersistentHistoryHeader");
+
+  /**
+   * Code identifying the UserType stored in a persistent history file. Only trivially copyable types can be persisted.
+   */
+  template<typename T>
+  constexpr uint32_t persistentTypeCode() {
+    static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be persisted");
+    return static_cast<uint32_t>(sizeof(T)) | (std::is_floating_point<T>::value ? 0x100U : 0U) |
+        (std::is_signed<T>::value ? 0x200U : 0U) | (std::is_same<T, Boolean>::value ? 0x400U : 0U);
+  }
+
+  /** Version of the layout of the export blob, see HistoryExportHeader */
+  constexpr uint32_t historyExportFormatVersion{1};
+
+  /**
+   * Header at the beginning of the export blob, see ServerHistoryConfig::exportTrigger. It is followed by one
+   * HistoryExportSection per history. All values are stored in the byte order of the server and all sections start at
+   * 8 byte boundaries.
+   */
+  struct HistoryExportHeader {
+    char magic[8];                ///< Always "CTKHEXP"
+    uint32_t formatVersion;       ///< See historyExportFormatVersion
+    uint32_t nHistories;          ///< Number of sections following the header
+    uint32_t timeStampResolution; ///< Value of the TimeStampResolution of the time stamps
+    uint32_t reserved;
+    uint64_t sequenceNumber; ///< Number of exports since the start, starting with 0 for the initial value
+  };
+  static_assert(sizeof(HistoryExportHeader) == 32, "Unexpected padding in HistoryExportHeader");
+
+  /**
+   * Header of the section of one history in the export blob. It is followed by the name of the variable feeding the
+   * history (nameLength characters padded with zeros to the next 8 byte boundary), the time stamps (nSamples uint64_t,
+   * only if timeStamps is 1) and nElements data columns. Column i holds element i of all samples with the type
+   * identified by typeCode and is padded to the next 8 byte boundary. The samples are sorted starting with the oldest,
+   * compact sample codings are converted back to the UserType.
+   */
+  struct HistoryExportSection {
+    uint64_t sectionSize; ///< Size of the section in bytes, including this header
+    uint32_t typeCode;    ///< Identifies the UserType, see persistentTypeCode()
+    uint32_t nameLength;  ///< Length of the name in bytes, without padding
+    uint64_t nElements;   ///< Number of data columns
+    uint64_t nSamples;    ///< Number of samples in each column, i.e. the history length
+    uint32_t timeStamps;  ///< 1 if the section contains time stamps, 0 otherwise
+    uint32_t reserved;
+  };
+  static_assert(sizeof(HistoryExportSection) == 40, "Unexpected padding in HistoryExportSection");
+
+  /** Size rounded up to the next 8 byte boundary, used for the layout of the export blob */
+  constexpr size_t exportPadded(size_t size) {
+    return (size + 7) & ~size_t(7);
+  }
+
+  /**
+   * Memory mapped file holding the ring buffers of one history entry. If the file exists and its header matches the
+   * requested layout, the content is restored. Otherwise (e.g. if the history length or the number of elements has
+   * changed) the file is reinitialised with zeros. The file is locked while it is open, so opening a file which is
+   * already used by another history throws a logic_error.
+   * Since the file is mapped, writing to the ring buffers does not need any system call.
+   */
+  class PersistentHistoryFile {
+   public:
+    static constexpr uint32_t formatVersion{2};
+
+    /**
+     * Open or create the file.
+     * \param fileName Name of the file.
+     * \param typeCode Code of the UserType, see persistentTypeCode().
+     * \param elementSize Size of one element of the data ring buffer in bytes.
+     * \param historyLength Number of entries in the ring buffers.
+     * \param nElements Number of elements per entry of the data ring buffer.
+     * \param timeStampLength Number of entries in the time stamp ring buffer.
+     */
+    PersistentHistoryFile(const std::string& fileName, uint32_t typeCode, size_t elementSize, size_t historyLength,
+        size_t nElements, size_t timeStampLength);
+    ~PersistentHistoryFile();
+
+    PersistentHistoryFile(const PersistentHistoryFile&) = delete;
+    PersistentHistoryFile& operator=(const PersistentHistoryFile&) = delete;
+
+    PersistentHistoryHeader& header() { return *static_cast<PersistentHistoryHeader*>(_mapping); }
+
+    /** Update the header after a sample has been written. The cursor is the ring index of the next sample. */
+    void advance(uint64_t cursor) {
+      auto& head = header();
+      head.cursor = cursor;
+      if(head.nSamples < head.historyLength) ++head.nSamples;
+    }
+
+    /** Start of the data ring buffer */
+    void* data() { return static_cast<char*>(_mapping) + sizeof(PersistentHistoryHeader); }
+
+    /** Start of the time stamp ring buffer */
+    uint64_t* timeStamps() { return reinterpret_cast<uint64_t*>(static_cast<char*>(_mapping) + _timeStampOffset); }
+
+    /** True if the content has been restored from an existing file */
+    bool restored() const { return _restored; }
+
+   private:
+    void* _mapping{nullptr};
+    size_t _size{0};
+    size_t _timeStampOffset{0};
+    bool _restored{false};
+    int _fd{-1}; ///< Kept open to hold the lock on the file
+  };
+
+  /** Version of the layout of the shared memory segment, see SharedHistorySegmentHeader */
+  constexpr uint32_t sharedHistoryFormatVersion{1};
+
+  /**
+   * Header at the beginning of the shared memory segment, see ServerHistoryConfig::sharedMemoryName. It is followed by
+   * nHistories entries, each starting with a SharedHistoryEntryHeader at an 8 byte boundary. The magic is written after
+   * the layout is complete, so readers should check it before using the segment.
+   */
+  struct SharedHistorySegmentHeader {
+    char magic[8];                ///< Always "CTKHSHM"
+    uint32_t formatVersion;       ///< See sharedHistoryFormatVersion
+    uint32_t nHistories;          ///< Number of entries following the header
+    uint32_t timeStampResolution; ///< Value of the TimeStampResolution of the time stamps
+    uint32_t reserved;
+    uint64_t segmentSize; ///< Size of the segment in bytes
+  };
+  static_assert(sizeof(SharedHistorySegmentHeader) == 32, "Unexpected padding in SharedHistorySegmentHeader");
+
+  /**
+   * Header of one history in the shared memory segment. It is followed by the name of the variable feeding the history
+   * (padded with zeros to the next 8 byte boundary), the data ring and the time stamp ring.
+   * The samples are counted since the start of the server, starting with the samples restored from a snapshot (see
+   * ServerHistoryConfig::snapshotFile). Sample n is stored in row n % historyLength of both rings.
+   * Each row of the data ring holds nElements values of the type identified by typeCode.
+   * The counters implement a sequence lock: before writing sample n the server sets started to n+1, afterwards it
+   * sets finished to n+1. A reader loads finished (with acquire semantics), copies the rows it needs, and loads started
+   * after an acquire fence. The copied samples with numbers n >= started - historyLength were not overwritten while
+   * reading. Readers never block the server.
+   */
+  struct SharedHistoryEntryHeader {
+    std::atomic<uint64_t> started;  ///< Number of samples the server started to write
+    std::atomic<uint64_t> finished; ///< Number of samples completely written
+    uint64_t entrySize;             ///< Size of the entry in bytes including this header, i.e. offset to the next entry
+    uint32_t typeCode;              ///< Identifies the UserType, see persistentTypeCode()
+    uint32_t nameLength;            ///< Length of the name in bytes, without padding
+    uint64_t nElements;             ///< Number of elements per row of the data ring
+    uint64_t historyLength;         ///< Number of rows of the rings
+    uint64_t dataOffset;            ///< Offset of the data ring from the start of this header
+    uint64_t timeStampOffset;       ///< Offset of the time stamp ring, 0 without time stamps
+  };
+  static_assert(sizeof(SharedHistoryEntryHeader) == 64, "Unexpected padding in SharedHistoryEntryHeader");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "The shared memory counters must be lock free");
+
+  /**
+   * POSIX shared memory segment holding the ring buffers of the histories of one module, see
+   * ServerHistoryConfig::sharedMemoryName. An existing segment with the same name is unlinked and a new, zero-filled
+   * segment is created. The segment is removed when the object is destroyed, unless it has been replaced already.
+   * Readers which have mapped a previous segment keep a valid mapping of it, but it is no longer updated, so they have
+   * to open the segment by name again (e.g. when the finished counters stop increasing) to follow a restarted server.
+   */
+  class SharedHistorySegment {
+   public:
+    /**
+     * Create the segment.
+     * \param name Name of the segment, starting with a slash, see shm_open().
+     * \param size Size of the segment in bytes.
+     */
+    SharedHistorySegment(const std::string& name, size_t size);
+    ~SharedHistorySegment();
+
+    SharedHistorySegment(const SharedHistorySegment&) = delete;
+    SharedHistorySegment& operator=(const SharedHistorySegment&) = delete;
+
+    SharedHistorySegmentHeader& header() { return *static_cast<SharedHistorySegmentHeader*>(_mapping); }
+
+    /** Start of the segment */
+    char* data() { return static_cast<char*>(_mapping); }
+
+   private:
+    std::string _name;
+    void* _mapping{nullptr};
+    size_t _size{0};
+    ino_t _inode{0}; ///< Identifies the segment, so a newer segment with the same name is not removed
+  };
+
+  /**
+   * Read-only memory mapped snapshot of histories in the layout of the export blob (see HistoryExportHeader), e.g. the
+   * content of the export output saved by an archiver. The file is mapped and its sections are indexed by name in one
+   * sequential pass. A missing file results in an empty snapshot. If the file is not a valid snapshot, a message is
+   * printed and the snapshot is empty as well.
+   */
+  class HistorySnapshotFile {
+   public:
+    explicit HistorySnapshotFile(const std::string& fileName);
+    ~HistorySnapshotFile();
+
+    HistorySnapshotFile(const HistorySnapshotFile&) = delete;
+    HistorySnapshotFile& operator=(const HistorySnapshotFile&) = delete;
+
+    /** Section of the history fed by the variable with the given name, nullptr if not in the snapshot */
+    const HistoryExportSection* find(std::string_view name) const;
+
+    /** Value of the TimeStampResolution of the time stamps in the snapshot */
+    uint32_t timeStampResolution() const { return _timeStampResolution; }
+
+   private:
+    void* _mapping{nullptr};
+    size_t _size{0};
+    uint32_t _timeStampResolution{0};
+    std::unordered_map<std::string_view, const HistoryExportSection*> _sections;
+  };
+
+}} // namespace ChimeraTK::history
@@ -13,13 +13,45 @@
  * module.
  * In order use the Server history create a \c ServerHistory module.
  * All variables that have the correct tag (default: "history") will be added to the Server history.
- * The history length is set during module construction and fixed per module.
+ * The history length is set during module construction. It can be chosen per variable with tags like
+ * "history:5000" or with profiles, see \c ServerHistoryConfig::tagProfiles.
  * Every time one of the variable handled by the history module is updated it will be filled into the
  * history buffer. The buffer length (history length) can not be changed during
  * runtime. Finally, one can create an additional buffer for each history
  * buffer that includes the time stamps of each data point in the history buffer.
  * This is useful if not all history buffers are filled with the same rate or the
  * rate is not known.
+ * Internally the history is kept in ring buffers. By default the published buffers are sorted, starting with the
+ * oldest entry. If \c ServerHistoryConfig::publishRawRing is set, the buffers are published in ring order together
+ * with the index of the oldest entry, which saves copying the complete buffer on every update.
+ * To keep long time windows without long raw history buffers, decimation stages can be configured
+ * (see \c ServerHistoryConfig::decimationStages), which hold the mean, minimum and maximum of a fixed number of
+ * entries of the previous stage.
+ * By default the history outputs are written on every update of the input. For fast inputs the publication can be
+ * rate limited or bound to a trigger (see \c ServerHistoryConfig::publishInterval and
+ * \c ServerHistoryConfig::publishTrigger), while all samples are still recorded.
+ * If \c ServerHistoryConfig::persistencePath is set, the ring buffers are kept in memory mapped files, so the
+ * history is restored after a restart of the server.
+ * Alternatively the histories can be filled from a saved export at startup, see \c ServerHistoryConfig::snapshotFile.
+ * Processes on the same host can read the histories from a shared memory segment, see
+ * \c ServerHistoryConfig::sharedMemoryName.
+ * Large numbers of variables can be distributed over several threads by setting
+ * \c ServerHistoryConfig::numberOfShards.
+ * The memory needed by long histories can be reduced with compact storage codings, see
+ * \c ServerHistoryConfig::storagePolicy.
+ * Slowly varying inputs can be recorded only on changes or with a deadband, see
+ * \c ServerHistoryConfig::recordingPolicy.
+ * Statistics over the history buffers can be published, see \c ServerHistoryConfig::enableStatistics.
+ * Other modules of the server can read time ranges of a history without copying the buffers, see
+ * \c ServerHistory::getRange().
+ * To reduce the load caused by long histories, only the new samples can be published, see
+ * \c ServerHistoryConfig::appendSize.
+ * The complete history can be exported in one packed output, see \c ServerHistoryConfig::exportTrigger.
+ * The samples around an event like an interlock can be frozen in capture outputs, see
+ * \c ServerHistoryConfig::captureTrigger.
+ * The variables added by addSource() can be selected with include and exclude patterns, see \c SourceFilter.
+ * Diagnostics like the processing time per update and the number of queued updates are published if
+ * \c ServerHistoryConfig::enableStatus is set.
  *
  *
  *  Output variables created by the \c ServerHistory module are named like their
@@ -28,7 +60,9 @@
  * process variables n history buffers are created (where n is the Array size)
  * and the element index i is appended to the feeding process variable name. In
  * consequence an input array of length i will result in i output history
- * arrays. The following tags are added to the history output variable:
+ * arrays. If \c ServerHistoryConfig::arrayAsMatrix is set, a single output of length historyLength*n is created
+ * instead, holding one row of n elements per history entry.
+ * The following tags are added to the history output variable:
  *  - Name of the history module with the suffix "_internal" appended
  *
  * The connection of variables with the 'history' tag to the ServerHistory module is
@@ -86,28 +120,745 @@
 
 #include <unordered_set>
 
+#include "HistoryStatistics.h"
+#include "HistoryStorage.h"
+
 #include <ChimeraTK/ApplicationCore/ApplicationModule.h>
 #include <ChimeraTK/ApplicationCore/ArrayAccessor.h>
 #include <ChimeraTK/ApplicationCore/DeviceModule.h>
+#include <ChimeraTK/ApplicationCore/ScalarAccessor.h>
 #include <ChimeraTK/ApplicationCore/VariableGroup.h>
 #include <ChimeraTK/SupportedUserTypes.h>
 
+#include <array>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <regex>
 #include <string>
 #include <tuple>
+#include <typeinfo>
+#include <unordered_map>
 #include <vector>
 
 namespace ChimeraTK { namespace history {
 
   //  struct AccessorAttacher;
 
+  /** Resolution of the time stamps stored in the time stamp buffers. */
+  enum class TimeStampResolution { seconds, milliseconds, microseconds, nanoseconds };
+
+  /**
+   * Configuration of a decimation stage. A decimation stage combines a fixed number of entries of the previous stage
+   * (or of the raw history for the first stage) into one entry holding the mean, minimum and maximum. This way long
+   * time windows can be kept without large raw history buffers. The statistics are computed incrementally while
+   * filling the raw history.
+   */
+  struct DecimationStage {
+    std::string name;     ///< Name of the stage, used as suffix of the stage outputs, e.g. "1s"
+    size_t factor;        ///< Number of entries of the previous stage combined into one entry of this stage
+    size_t historyLength; ///< Length of the ring buffers of this stage
+  };
+
+  /**
+   * Coding of the samples in the history ring buffers. Samples are converted back to the UserType of the input when
+   * the history outputs are written, so only the precision of the stored samples changes.
+   */
+  enum class SampleCoding {
+    native,   ///< Samples are stored with the UserType of the input
+    float32,  ///< Samples of type double are stored as float, other types are stored natively
+    quantised,  ///< Arithmetic samples wider than 16 bits are stored as 16 bit multiples of the quantisation step
+    stringSlots ///< Samples of type std::string are stored in slots of stringSlotSize bytes, see StringSlotBuffer
+  };
+
+  /**
+   * Storage policy of the history ring buffers, see ServerHistoryConfig::storagePolicy.
+   */
+  struct HistoryStoragePolicy {
+    SampleCoding coding{SampleCoding::native}; ///< Coding of the data ring buffers
+    double quantisationStep{1.};               ///< Value of one step of the quantised coding
+    size_t stringSlotSize{64};                 ///< Maximum length of strings stored with the stringSlots coding
+    /**
+     * Store the time stamps as 32 bit offsets to a common base instead of 64 bit values, see CompactTimeStampBuffer.
+     * The time span covered by one ring buffer must fit into 2^32-1 units of the timeStampResolution.
+     */
+    bool compactTimeStamps{false};
+    /**
+     * Allocate the ring buffers when the first sample is recorded instead of at construction, so variables which are
+     * never updated do not use memory for their history. Not used with persistence.
+     *
+     * Only the internal ring buffers are deferred. The history outputs are created with their full length at
+     * construction, so the total memory does not follow the set of updated variables. The status output ringMemory
+     * counts the ring buffers only, the memory of the outputs is published as outputMemory.
+     */
+    bool lazyAllocation{false};
+  };
+
+  /**
+   * Coding actually used for the given UserType, sample codings not applicable to the type fall back to the native
+   * coding.
+   */
+  template<typename UserType>
+  constexpr SampleCoding effectiveCoding(SampleCoding coding) {
+    if(coding == SampleCoding::float32 && std::is_same<UserType, double>::value) return coding;
+    if(coding == SampleCoding::quantised && std::is_arithmetic<UserType>::value && sizeof(UserType) > 2) return coding;
+    if(coding == SampleCoding::stringSlots && std::is_same<UserType, std::string>::value) return coding;
+    return SampleCoding::native;
+  }
+
+  /** Recording mode of a history, see RecordingPolicy */
+  enum class RecordingMode {
+    always,           ///< Every update of the input is recorded
+    changeOnly,       ///< Updates are only recorded if an element differs from the last recorded sample
+    absoluteDeadband, ///< Updates are only recorded if an element differs by more than the deadband
+    relativeDeadband  ///< Like absoluteDeadband, with the deadband relative to the absolute value of the element
+  };
+
+  /**
+   * Recording policy of a history, see ServerHistoryConfig::recordingPolicy. Deadbands are only applied to arithmetic
+   * types, other types fall back to RecordingMode::changeOnly.
+   */
+  struct RecordingPolicy {
+    RecordingMode mode{RecordingMode::always};
+    double deadband{0.}; ///< Absolute deadband or fraction of the last recorded value, depending on the mode
+  };
+
+  /**
+   * Handling of updates arriving while the queue of an input is full, see HistoryProfile::queueLength. The default is
+   * block, dropping samples has to be selected explicitly.
+   */
+  enum class OverrunPolicy {
+    block,      ///< The queued samples are recorded before the update is queued, so no samples are dropped
+    dropOldest, ///< The oldest queued sample is dropped
+    coalesce    ///< The newest queued sample is replaced by the update, so the queue always ends with the latest value
+  };
+
+  /**
+   * Per variable settings of a history, see ServerHistoryConfig::tagProfiles and ServerHistory::addSource().
+   */
+  struct HistoryProfile {
+    size_t historyLength{1200};   ///< Length of the ring buffers
+    bool enableTimeStamps{false}; ///< If enabled addition ring buffers for time stamps are created
+    /**
+     * Length of the queue of the input inside the module, 0 disables the queue. Updates received in one burst (i.e.
+     * without waiting in the main loop) are collected in the queue and recorded together at the end of the burst, so
+     * the history is published once per burst instead of once per update. If the queue is full, the overrunPolicy is
+     * applied. With dropping policies the number of dropped samples is counted and published for each entry of the
+     * history in an output with the suffix "_dropped".
+     *
+     * The queue only shapes bursts which have already been received by the module. It does not replace the queue of
+     * the ApplicationCore input, which is filled by the sender and loses data if the module falls behind. Such losses
+     * are not visible in the "_dropped" outputs, see ServerHistoryConfig::reportDataLoss.
+     *
+     * If not set, ServerHistoryConfig::queueLength is used, so a profile which only sets the history length (e.g. in
+     * ServerHistoryConfig::tagProfiles) keeps the queue settings of the module.
+     */
+    std::optional<size_t> queueLength{};
+    std::optional<OverrunPolicy> overrunPolicy{}; ///< If not set, ServerHistoryConfig::overrunPolicy is used
+  };
+
+  /**
+   * Selection of the variables of a device, see ServerHistory::addSource(). A variable is selected if its fully
+   * qualified path (e.g. "/ADC/channel3") matches at least one include pattern, or if there is no include pattern,
+   * and none of the exclude patterns. The patterns are compiled when they are added, so each variable is checked
+   * without parsing the patterns again.
+   */
+  class SourceFilter {
+   public:
+    /**
+     * Syntax of the patterns. In glob patterns "*" matches any characters except "/", "**" any characters and "?" one
+     * character except "/". Regular expressions use the ECMAScript syntax of std::regex. Both have to match the
+     * complete path.
+     */
+    enum class Syntax { glob, regex };
+
+    /** Add an include pattern. Throws a logic_error if the pattern is invalid. */
+    SourceFilter& include(const std::string& pattern, Syntax syntax = Syntax::glob);
+
+    /** Add an exclude pattern. Throws a logic_error if the pattern is invalid. */
+    SourceFilter& exclude(const std::string& pattern, Syntax syntax = Syntax::glob);
+
+    /** Check whether the variable with the given fully qualified path is selected */
+    bool matches(const std::string& path) const;
+
+   private:
+    std::vector<std::regex> _include;
+    std::vector<std::regex> _exclude;
+  };
+
+  /**
+   * Configuration of the ServerHistory module. The first members correspond to the parameters of the classic
+   * ServerHistory constructor.
+   */
+  struct ServerHistoryConfig {
+    size_t historyLength{1200};        ///< Length of the ring buffers used by the server history module
+    std::string historyTag{"history"}; ///< The tag used to identify server history PVs
+    bool enableTimeStamps{false};      ///< If enabled addition ring buffers for time stamps are created
+    std::string prefix{"History"};     ///< The prefix will determine the directory where server history PVs appear
+
+    /**
+     * If enabled the history outputs are published in ring order instead of being sorted from the oldest to the
+     * newest entry. For each input an additional scalar output with the suffix "_head" is created, which holds the
+     * index of the oldest entry (which is also the index the next entry will be written to). Clients that can handle
+     * this avoid that the complete history is copied on every update.
+     */
+    bool publishRawRing{false};
+
+    /**
+     * If enabled the history of an array input is published as a single output of length historyLength*nElements
+     * instead of one output per element. The output is a flattened matrix with one row per history entry, i.e.
+     * element i of history entry k is found at index k*nElements+i. Only one time stamp buffer is created per input.
+     */
+    bool arrayAsMatrix{false};
+
+    /**
+     * If enabled only one time stamp buffer with the suffix "_timeStamps" is created per array input, instead of one
+     * buffer per element. All elements of an input are updated at the same time, so the buffers would be identical.
+     * This setting has no effect on scalars and matrix histories, which always have a single time stamp buffer.
+     */
+    bool sharedTimeStamps{false};
+
+    /**
+     * Resolution of the time stamps. The time stamps are taken from the VersionNumber of the input and are given as
+     * time since epoch.
+     */
+    TimeStampResolution timeStampResolution{TimeStampResolution::seconds};
+
+    /**
+     * Decimation stages added to the history of each numeric input. The stages are cascaded, so e.g. the stages
+     * {{"1s", 10, 1200}, {"1min", 60, 1200}} create 1200 one-second and 1200 one-minute entries for a variable
+     * updated with 10 Hz. For each stage the outputs with the suffixes "_<name>_mean", "_<name>_min" and
+     * "_<name>_max" (and "_<name>_timeStamps" if time stamps are enabled) are created. They always use the matrix
+     * layout, i.e. one output holding all elements of the input. Inputs of type std::string and Boolean are not
+     * decimated.
+     */
+    std::vector<DecimationStage> decimationStages;
+
+    /**
+     * Path of a push-type variable used as publish trigger, e.g. the output of a PeriodicTrigger. If set, new samples
+     * are still recorded immediately, but the history outputs are only written when the trigger is received. All
+     * histories updated since the last trigger are written together. This limits the load on the control system
+     * adapter caused by fast inputs.
+     */
+    std::string publishTrigger;
+
+    /**
+     * Minimum time between two publications of the history outputs. Samples arriving in between are recorded and
+     * published together with the next publication. Since publications are only checked when a sample arrives, a
+     * publishTrigger should be used in addition to make sure the last samples are published in time. Zero disables
+     * the rate limit.
+     */
+    std::chrono::milliseconds publishInterval{0};
+
+    /**
+     * If larger than 0, new samples are published in an output with the suffix "_append" (and "_append_timeStamps" if
+     * time stamps are enabled) instead of writing the complete history outputs. The append output holds up to
+     * appendSize samples of all elements, starting with the oldest new sample, i.e. element i of new sample k is
+     * found at index k*nElements+i. The scalar output with the suffix "_sequence" holds the number of samples recorded
+     * since the start and is written with every publication, so the number of new samples is the difference to the
+     * previous sequence number. If more samples have been recorded since the last publication than fit into the append
+     * output, the complete history is published instead.
+     * This way clients can rebuild the history locally while only the new samples are transferred. The complete
+     * history outputs are written for resynchronisation, see resyncInterval and resyncTrigger. All outputs written by
+     * one publication have the same VersionNumber.
+     */
+    size_t appendSize{0};
+
+    /** Interval of publishing the complete histories if appendSize is set, zero disables the periodic publication */
+    std::chrono::milliseconds resyncInterval{0};
+
+    /**
+     * Path of a push-type variable used as resynchronisation trigger if appendSize is set. The complete histories are
+     * published when the trigger is received, e.g. when requested by a client.
+     */
+    std::string resyncTrigger;
+
+    /**
+     * Directory for persistent history files. If set, the ring buffers of each history are kept in a memory mapped
+     * file in this directory, so the history survives a restart of the server. The file name is derived from the
+     * history name. If the layout stored in an existing file does not match (e.g. because the history length or the
+     * number of elements changed), the history is reset. Decimation stages and inputs of type std::string are not
+     * persisted.
+     */
+    std::string persistencePath;
+
+    /**
+     * Snapshot file used to fill the histories when the module is prepared, so the histories do not start empty after
+     * a restart. The file has the layout of the export output (see exportTrigger and HistoryExportHeader), e.g. the
+     * export saved by an archiver, and it is memory mapped and read in one sequential pass. Histories are matched by
+     * the name of the feeding variable; if the history length differs, the newest samples are used. Histories
+     * restored from persistencePath, decimation stages and inputs of type std::string are not filled. A missing file
+     * is ignored.
+     */
+    std::string snapshotFile;
+
+    /**
+     * Name of a POSIX shared memory segment, e.g. "/ctkHistory". If set, the ring buffers are kept in this segment
+     * (shards use the name with the suffix "_shard<i>"), so analysis processes on the same host can map it and read
+     * the histories without copies and without any interaction with the server. The layout is described at
+     * SharedHistorySegmentHeader. The segment is created when the module is prepared. Inputs of type std::string are
+     * not included. Shared memory cannot be combined with persistencePath or compact storage codings.
+     */
+    std::string sharedMemoryName;
+
+    /**
+     * Number of threads used to update the histories. If larger than 1, the variables are distributed round robin
+     * over additional internal ApplicationModules (named like the ServerHistory module with the suffix "_shard<i>"),
+     * each running its own main loop. The names of the history PVs do not depend on this setting. The triggers are
+     * only connected to the ServerHistory module, which forwards them to the shards, and the status and export of the
+     * module include all shards. The variables exchanged with the shards are placed in the directory "shards" of the
+     * module.
+     */
+    size_t numberOfShards{1};
+
+    /**
+     * If enabled, the mean, RMS, minimum and maximum of each element over all samples in the history buffer are
+     * published in outputs with the suffixes "_mean", "_rms", "_min" and "_max", holding one value per element. The
+     * statistics are updated incrementally, see WindowStatistics. Only used for arithmetic types.
+     */
+    bool enableStatistics{false};
+
+    /**
+     * Record scalar histories without optional features with a specialised path, see HistoryEntry::plainScalar. Only
+     * meant to be disabled to compare both paths, e.g. in the benchmarks.
+     */
+    bool scalarFastPath{true};
+
+    /**
+     * Storage policy of the ring buffers. Compact codings reduce the memory needed for long histories at the cost of
+     * precision. They cannot be combined with persistencePath.
+     */
+    HistoryStoragePolicy storagePolicy;
+
+    /**
+     * Storage policies used instead of storagePolicy for variables with the given tags. If a variable has several of
+     * the tags, the policy of the first tag in the map is used.
+     */
+    std::map<std::string, HistoryStoragePolicy> tagStoragePolicies;
+
+    /**
+     * Recording policy of the histories. If updates are skipped, the entries of the history are no longer equally
+     * spaced in time, so time stamps should be enabled. Skipped updates are counted, see ServerHistoryStatus.
+     */
+    RecordingPolicy recordingPolicy;
+
+    /** Recording policies used instead of recordingPolicy for variables with the given tags, like tagStoragePolicies */
+    std::map<std::string, RecordingPolicy> tagRecordingPolicies;
+
+    /**
+     * Profiles used instead of historyLength and enableTimeStamps for variables with the given tags, like
+     * tagStoragePolicies. In addition the history length of a variable can be set with a tag consisting of the
+     * historyTag, a colon and the length, e.g. "history:5000", which takes precedence over the profiles.
+     */
+    std::map<std::string, HistoryProfile> tagProfiles;
+
+    /**
+     * If enabled, diagnostics of the module are published in the directory "status" of the module, see
+     * ServerHistoryStatus. With several shards the status of each shard is included as received with its last status
+     * update, so it can lag behind by one status interval.
+     */
+    bool enableStatus{false};
+
+    /**
+     * If enabled together with enableStatus, the number of recorded samples is published for each variable in an
+     * output with the suffix "_updateCount".
+     */
+    bool enableVariableStatus{false};
+
+    /** Length of the input queues of variables without profile, see HistoryProfile::queueLength */
+    size_t queueLength{0};
+
+    /** Overrun policy of variables without profile, see HistoryProfile::queueLength */
+    OverrunPolicy overrunPolicy{OverrunPolicy::block};
+
+    /**
+     * If enabled together with enableStatus, the number of updates lost by the ApplicationCore transport, i.e. written
+     * while the queue of the receiving input was full, is published in the status output "dataLossCount". This is the
+     * overrun of the actual inputs, in contrast to overrunCount, which only counts the samples dropped by the queues
+     * inside the module (see HistoryProfile::queueLength). The counter of ApplicationCore covers the whole application
+     * and is reset when read, so it should only be reported by one module. Shards never report it.
+     */
+    bool reportDataLoss{false};
+
+    /** Interval of the status updates. The status is updated when processing an input after this time has passed. */
+    std::chrono::milliseconds statusInterval{1000};
+
+    /**
+     * Path of a push-type variable used as export trigger. If set, the contents of all ring buffers including the time
+     * stamps are packed into the output "export" of the module (including all shards), which is written when the
+     * trigger is received (with several shards once all shards have contributed their histories). This way an
+     * archiver can read the complete history in one transfer instead of reading each history output. The trigger can
+     * be written by the client on request or by a slow PeriodicTrigger. The layout of the output is described at
+     * HistoryExportHeader. Inputs of type std::string are not exported.
+     */
+    std::string exportTrigger;
+
+    /**
+     * Path of a push-type variable used as capture trigger, e.g. an interlock event. If set, each history gets an
+     * output with the suffix "_capture" (and "_capture_timeStamps" if time stamps are enabled), holding the
+     * capturePreSamples samples recorded before the trigger followed by the capturePostSamples samples recorded after
+     * it. The samples start with the oldest and hold all elements each. The outputs are filled when the last
+     * post-trigger sample is recorded and keep the capture until the next one, while the live history continues.
+     * Triggers received while a capture still waits for post-trigger samples are ignored. The capture window must
+     * not be longer than the history.
+     */
+    std::string captureTrigger;
+    size_t capturePreSamples{0};  ///< See captureTrigger
+    size_t capturePostSamples{0}; ///< See captureTrigger
+  };
+
+  /**
+   * Diagnostic outputs of the ServerHistory module, see ServerHistoryConfig::enableStatus.
+   */
+  struct ServerHistoryStatus : public VariableGroup {
+    using VariableGroup::VariableGroup;
+
+    ScalarOutput<uint64_t> updateCount{this, "updateCount", "", "Number of samples recorded since the start"};
+    ScalarOutput<uint64_t> skippedCount{
+        this, "skippedCount", "", "Number of updates not recorded due to the recording policy since the start"};
+    ScalarOutput<uint64_t> backlogCount{this, "backlogCount", "",
+        "Number of updates which were already queued when the previous update was finished"};
+    ScalarOutput<uint64_t> overrunCount{
+        this, "overrunCount", "", "Number of samples dropped due to full queues inside the module since the start"};
+    ScalarOutput<uint64_t> dataLossCount{this, "dataLossCount", "",
+        "Number of updates lost by the application due to full input queues, see ServerHistoryConfig::reportDataLoss"};
+    ScalarOutput<uint32_t> maxQueueDepth{this, "maxQueueDepth", "",
+        "Maximum number of updates processed without waiting during the last status interval"};
+    ScalarOutput<float> processingTimeP50{
+        this, "processingTimeP50", "us", "Median processing time per update during the last status interval"};
+    ScalarOutput<float> processingTimeP99{
+        this, "processingTimeP99", "us", "99th percentile of the processing time per update"};
+    ScalarOutput<uint64_t> ringMemory{this, "ringMemory", "bytes", "Memory used by the ring buffers"};
+    ScalarOutput<uint64_t> outputMemory{
+        this, "outputMemory", "bytes", "Memory used by the values of the history outputs, allocated at the start"};
+  };
+
+  /**
+   * Histogram of processing times with logarithmic bins. Bin i holds the times between 2^(i-1) and 2^i nanoseconds,
+   * so adding a measurement is cheap enough for every update.
+   */
+  class ProcessingTimeHistogram {
+   public:
+    void add(std::chrono::steady_clock::duration time) {
+      auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+      size_t bin = 0;
+      while(ns > 0 && bin + 1 < _bins.size()) {
+        ns >>= 1;
+        ++bin;
+      }
+      ++_bins[bin];
+      ++_count;
+    }
+
+    /** Upper bound of the bin containing the given quantile, in microseconds */
+    float quantile(double q) const {
+      if(_count == 0) return 0;
+      auto target = static_cast<uint64_t>(q * static_cast<double>(_count));
+      uint64_t sum = 0;
+      for(size_t bin = 0; bin < _bins.size(); ++bin) {
+        sum += _bins[bin];
+        if(sum > target) return static_cast<float>(1ULL << bin) / 1000.F;
+      }
+      return static_cast<float>(1ULL << (_bins.size() - 1)) / 1000.F;
+    }
+
+    void reset() {
+      _bins.fill(0);
+      _count = 0;
+    }
+
+    static constexpr size_t nBins = 48;
+
+    /** Counts of the bins, e.g. to combine the histograms of several modules with addBins() */
+    const std::array<uint64_t, nBins>& bins() const { return _bins; }
+
+    /** Add the given counts of nBins bins, see bins() */
+    void addBins(const uint64_t* bins) {
+      for(size_t bin = 0; bin < nBins; ++bin) {
+        _bins[bin] += bins[bin];
+        _count += bins[bin];
+      }
+    }
+
+   private:
+    std::array<uint64_t, nBins> _bins{};
+    uint64_t _count{0};
+  };
+
+  /**
+   * Ring buffers and accumulators of one decimation stage of a history entry. The ring layout is the same as for
+   * HistoryEntry::ring.
+   */
+  template<typename UserType>
+  struct DecimationEntry {
+    DecimationEntry(const DecimationStage& stage, size_t elements, bool enableTimeStamps)
+    : factor(stage.factor), historyLength(stage.historyLength), withTimeStamps(enableTimeStamps), sum(elements),
+      binMin(elements), binMax(elements) {}
+
+    /** Allocate the ring buffers, see HistoryEntry::allocateRings() */
+    void allocateRings() {
+      auto nElements = sum.size();
+      meanRing.resize(historyLength * nElements);
+      minRing.resize(historyLength * nElements);
+      maxRing.resize(historyLength * nElements);
+      timeStampRing.resize(withTimeStamps ? historyLength : 0);
+    }
+
+    ArrayOutput<double> mean;
+    ArrayOutput<UserType> min;
+    ArrayOutput<UserType> max;
+    ArrayOutput<uint64_t> timeStamp; ///< Time stamp of the last entry contributing to the decimated entry
+
+    size_t factor;
+    size_t historyLength;
+    bool withTimeStamps;
+    std::vector<double> meanRing;
+    std::vector<UserType> minRing;
+    std::vector<UserType> maxRing;
+    std::vector<uint64_t> timeStampRing;
+    size_t cursor{0};
+    bool unpublished{false}; ///< A new entry was added since the last publication
+
+    /** Accumulators of the decimated entry currently being filled */
+    std::vector<double> sum;
+    std::vector<UserType> binMin;
+    std::vector<UserType> binMax;
+    size_t count{0};
+  };
+
   template<typename UserType>
   struct HistoryEntry {
-    HistoryEntry(bool enableHistory)
+    HistoryEntry(const ServerHistoryConfig& config, size_t elements, const HistoryProfile& profile,
+        const HistoryStoragePolicy& policy, const RecordingPolicy& recordingPolicy)
     : data(std::vector<ArrayOutput<UserType>>{}), timeStamp(std::vector<ArrayOutput<uint64_t>>{}),
-      withTimeStamps(enableHistory) {}
+      withTimeStamps(profile.enableTimeStamps), publishRawRing(config.publishRawRing),
+      matrix(config.arrayAsMatrix && elements > 1), timeStampResolution(config.timeStampResolution),
+      nElements(elements), historyLength(profile.historyLength), coding(effectiveCoding<UserType>(policy.coding)),
+      quantisationStep(policy.quantisationStep), stringSlotSize(policy.stringSlotSize),
+      compactTimeStamps(withTimeStamps && policy.compactTimeStamps), lazyAllocation(policy.lazyAllocation),
+      recordingMode(std::is_arithmetic<UserType>::value || recordingPolicy.mode == RecordingMode::always ?
+              recordingPolicy.mode :
+              RecordingMode::changeOnly),
+      deadband(recordingPolicy.deadband),
+      lastRecorded(recordingMode == RecordingMode::always ? 0 : nElements),
+      withStatistics(config.enableStatistics && std::is_arithmetic<UserType>::value), appendSize(config.appendSize),
+      queueLength(profile.queueLength.value_or(config.queueLength)),
+      overrunPolicy(profile.overrunPolicy.value_or(config.overrunPolicy)),
+      withGapMarkers(queueLength > 0 && overrunPolicy != OverrunPolicy::block), queue(queueLength * nElements),
+      queueTimeStamps(queueLength), queueDropped(queueLength) {
+      if constexpr(std::is_trivially_copyable<UserType>::value) {
+        // the segment is only created when all entries are known, see ServerHistory::attachSharedMemory()
+        inSharedMemory = !config.sharedMemoryName.empty();
+        if(inSharedMemory) lazyAllocation = false;
+      }
+    }
+
+    /**
+     * Allocate the ring buffers of the entry and its decimation stages. Only the ring buffer of the sample coding is
+     * allocated. The data and time stamp rings of persistent entries are already mapped to the file, the ones of
+     * entries in shared memory are mapped later.
+     */
+    void allocateRings() {
+      auto size = historyLength * nElements;
+      if(!persistentFile && !inSharedMemory) {
+        switch(coding) {
+          case SampleCoding::native:
+            ring = HistoryBuffer<UserType>(size);
+            break;
+          case SampleCoding::float32:
+            floatRing = HistoryBuffer<float>(size);
+            break;
+          case SampleCoding::quantised:
+            quantisedRing = HistoryBuffer<QuantisedType<UserType>>(size);
+            break;
+          case SampleCoding::stringSlots:
+            stringRing = StringSlotBuffer(size, stringSlotSize);
+            break;
+        }
+        if(compactTimeStamps) {
+          compactTimeStampRing = CompactTimeStampBuffer(historyLength);
+        }
+        else if(withTimeStamps) {
+          timeStampRing = HistoryBuffer<uint64_t>(historyLength);
+        }
+      }
+      if(withGapMarkers) droppedRing = HistoryBuffer<uint32_t>(historyLength);
+      for(auto& stage : decimation) stage.allocateRings();
+      if(withStatistics) statistics = WindowStatistics<UserType>(nElements, historyLength);
+      allocated = true;
+    }
+
     std::vector<ArrayOutput<UserType>> data;
     std::vector<ArrayOutput<uint64_t>> timeStamp;
+    ScalarOutput<uint32_t> head; ///< Only used if publishRawRing is enabled
     bool withTimeStamps;
+    bool publishRawRing;
+    bool matrix; ///< All elements are published in a single output
+    TimeStampResolution timeStampResolution;
+
+    size_t nElements;
+    size_t historyLength;
+    SampleCoding coding; ///< Coding of the samples, only the ring buffer of this coding is allocated
+    double quantisationStep;
+    size_t stringSlotSize;
+    bool compactTimeStamps;
+    bool lazyAllocation; ///< The ring buffers are allocated when the first sample is recorded
+    bool allocated{false};
+    /**
+     * Scalar input without any feature needing per-sample work besides storing the value and the time stamp, so the
+     * samples are recorded in a ScalarHistory. Set when the entry is added to the module.
+     */
+    bool plainScalar{false};
+    /** Ring buffer of all elements. Entry k of the ring holds one sample of the input and starts at k*nElements. */
+    HistoryBuffer<UserType> ring;
+    HistoryBuffer<float> floatRing;                            ///< Ring buffer used by SampleCoding::float32
+    HistoryBuffer<QuantisedType<UserType>> quantisedRing;      ///< Ring buffer used by SampleCoding::quantised
+    StringSlotBuffer stringRing;                               ///< Ring buffer used by SampleCoding::stringSlots
+    /** Ring buffer of the time stamps. It is shared by all elements, since they are updated at the same time. */
+    HistoryBuffer<uint64_t> timeStampRing;
+    CompactTimeStampBuffer compactTimeStampRing; ///< Used instead of timeStampRing if compactTimeStamps is set
+    /** Backing file of the ring buffers, only used if ServerHistoryConfig::persistencePath is set */
+    std::unique_ptr<PersistentHistoryFile> persistentFile;
+    bool restored{false}; ///< The ring buffers have been restored from the persistent file or a snapshot
+    size_t restoredSamples{0}; ///< Number of restored samples, which are the newest samples in the ring buffers
+    bool inSharedMemory{false}; ///< The ring buffers are mapped to the shared memory segment
+    SharedHistoryEntryHeader* shared{nullptr}; ///< Header of the entry in the shared memory segment
+    uint64_t updateCount{0};                  ///< Number of samples recorded
+    ScalarOutput<uint64_t> updateCountOutput; ///< Only used if ServerHistoryConfig::enableVariableStatus is set
+    size_t cursor{0};      ///< Ring index the next sample is written to, i.e. the index of the oldest sample
+    size_t cursorOffset{0}; ///< Ring index of the first sample recorded after the start, see writeCounter
+    WriteCounter writeCounter; ///< Number of samples written since the start, used by HistoryView
+    size_t unpublished{0}; ///< Number of samples recorded since the last publication
+
+    std::vector<DecimationEntry<UserType>> decimation; ///< Decimation stages, see ServerHistoryConfig
+
+    RecordingMode recordingMode;
+    double deadband;
+    std::vector<UserType> lastRecorded; ///< Last recorded sample, only used if updates can be skipped
+    bool hasRecorded{false};            ///< A sample has been recorded in lastRecorded
+    uint64_t skippedCount{0};           ///< Number of updates skipped due to the recording mode
+    ScalarOutput<uint64_t> skippedCountOutput; ///< Only used if ServerHistoryConfig::enableVariableStatus is set
+
+    bool withStatistics; ///< See ServerHistoryConfig::enableStatistics
+    WindowStatistics<UserType> statistics;
+    ArrayOutput<double> windowMean;
+    ArrayOutput<double> windowRms;
+    ArrayOutput<UserType> windowMin;
+    ArrayOutput<UserType> windowMax;
+
+    size_t appendSize; ///< See ServerHistoryConfig::appendSize
+    bool resyncPending{false}; ///< The complete history is published with the next publication
+    ArrayOutput<UserType> append;
+    ArrayOutput<uint64_t> appendTimeStamps;
+    ScalarOutput<uint64_t> sequence;
+
+    size_t queueLength;          ///< See HistoryProfile::queueLength
+    OverrunPolicy overrunPolicy; ///< See HistoryProfile::overrunPolicy
+    bool withGapMarkers;         ///< Samples can be dropped, so the dropped samples are recorded in droppedRing
+    std::vector<UserType> queue; ///< Queued samples, each holding nElements values
+    std::vector<uint64_t> queueTimeStamps;
+    std::vector<uint32_t> queueDropped; ///< Number of samples dropped before each queued sample
+    size_t queueFirst{0};               ///< Queue index of the oldest queued sample
+    size_t queueSize{0};
+    uint64_t pendingDropped{0}; ///< Number of samples dropped since the last recorded sample
+    /** Number of samples dropped before each entry of the ring, parallel to the time stamp ring */
+    HistoryBuffer<uint32_t> droppedRing;
+    ArrayOutput<uint32_t> dropped;
+    uint64_t overrunCount{0};                   ///< Number of samples dropped due to a full queue
+    ScalarOutput<uint64_t> overrunCountOutput; ///< Only used if ServerHistoryConfig::enableVariableStatus is set
+
+    size_t captureLength{0};    ///< Number of samples in the capture outputs, see ServerHistoryConfig::captureTrigger
+    size_t captureRemaining{0}; ///< Number of samples to record until the running capture is complete
+    bool capturePending{false}; ///< The capture outputs hold a completed capture which has not been written yet
+    ArrayOutput<UserType> capture;
+    ArrayOutput<uint64_t> captureTimeStamps;
+  };
+
+  /**
+   * Compact recording state of a scalar history without optional features, see HistoryEntry::plainScalar. It holds
+   * only what is needed to record a sample, and the scalar histories of one UserType are stored contiguously, so an
+   * update does not touch the HistoryEntry besides its ring buffers and write counter. The cursor and the counters
+   * are copied to the HistoryEntry before the entry is published or read otherwise, see syncEntry().
+   */
+  template<typename UserType>
+  struct ScalarHistory {
+    UserType* ring;              ///< HistoryEntry::ring
+    uint64_t* timeStampRing;     ///< HistoryEntry::timeStampRing, nullptr if time stamps are disabled
+    WriteCounter* writeCounter;  ///< HistoryEntry::writeCounter, which is read by HistoryView
+    size_t historyLength;
+    size_t cursor;
+    size_t unpublished;
+    uint64_t updateCount;
+    HistoryEntry<UserType>* entry; ///< Entry holding the outputs and the remaining state
+  };
+
+  /**
+   * View of a range of samples in the ring buffers of a history, see ServerHistory::getRange(). The samples are not
+   * copied, so they can be overwritten by the ServerHistory module while reading them. Check valid() after reading
+   * the samples and request the range again if it returns false.
+   */
+  template<typename UserType>
+  class HistoryView {
+   public:
+    HistoryView() = default;
+
+    /** Number of samples in the range, starting with the oldest sample */
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    size_t getNumberOfElements() const { return _entry ? _entry->nElements : 0; }
+
+    /** Element of the given sample, converted back to the UserType if a compact coding is used */
+    UserType value(size_t sample, size_t element = 0) const {
+      auto index = ringIndex(sample) * _entry->nElements + element;
+      if constexpr(std::is_arithmetic<UserType>::value) {
+        if(_entry->coding == SampleCoding::float32) return Float32Coding<UserType>{}.decode(_entry->floatRing[index]);
+        if(_entry->coding == SampleCoding::quantised) {
+          return QuantisedCoding<UserType>{_entry->quantisationStep}.decode(_entry->quantisedRing[index]);
+        }
+      }
+      if constexpr(std::is_same<UserType, std::string>::value) {
+        if(_entry->coding == SampleCoding::stringSlots) return std::string(_entry->stringRing[index]);
+      }
+      return _entry->ring[index];
+    }
+
+    uint64_t timeStamp(size_t sample) const { return _entry->timeStampRing[ringIndex(sample)]; }
+
+    /**
+     * Contiguous part of the range in the ring buffer, as pointer to the first element and number of samples. The range
+     * consists of up to two segments (0 and 1), since the ring buffer wraps around. Each sample holds
+     * getNumberOfElements() elements. Only available for the native sample coding, otherwise nullptr is returned.
+     */
+    std::pair<const UserType*, size_t> segment(size_t i) const {
+      if(_size == 0 || _entry->coding != SampleCoding::native) return {nullptr, 0};
+      auto firstSize = std::min(_size, _entry->historyLength - _first);
+      if(i == 0) return {_entry->ring.begin() + _first * _entry->nElements, firstSize};
+      if(firstSize == _size) return {nullptr, 0};
+      return {_entry->ring.begin(), _size - firstSize};
+    }
+
+    /** True as long as none of the samples in the range has been overwritten */
+    bool valid() const {
+      if(_size == 0) return true;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      auto started = static_cast<int64_t>(_entry->writeCounter.started.load(std::memory_order_relaxed));
+      return started <= _firstSample + static_cast<int64_t>(_entry->historyLength);
+    }
+
+   private:
+    friend class ServerHistory;
+    HistoryView(const HistoryEntry<UserType>& entry, size_t first, size_t size, int64_t firstSample)
+    : _entry(&entry), _first(first), _size(size), _firstSample(firstSample) {}
+
+    size_t ringIndex(size_t sample) const { return (_first + sample) % _entry->historyLength; }
+
+    const HistoryEntry<UserType>* _entry{nullptr};
+    size_t _first{0}; ///< Ring index of the first sample
+    size_t _size{0};
+    int64_t _firstSample{0}; ///< Number of the first sample counted since the start, see HistoryEntry::writeCounter
   };
 
   class ServerHistory : public ApplicationModule {
@@ -128,6 +879,17 @@ namespace ChimeraTK { namespace history {
         size_t historyLength = 1200, const std::string& historyTag = "history", bool enableTimeStamps = false,
         const std::string& prefix = "History", const std::unordered_set<std::string>& tags = {});
 
+    /**
+     * Constructor taking the complete module configuration.
+     * \param owner Owning module passed to ApplicationModule constructor.
+     * \param name Module name passed to ApplicationModule constructor.
+     * \param description Module description passed to ApplicationModule constructor.
+     * \param config The configuration of the module, see ServerHistoryConfig.
+     * \param tags Module tags passed to ApplicationModule constructor.
+     */
+    ServerHistory(ModuleGroup* owner, const std::string& name, const std::string& description,
+        const ServerHistoryConfig& config, const std::unordered_set<std::string>& tags = {});
+
     /** Default constructor, creates a non-working module. Can be used for late
      * initialisation. */
     ServerHistory() {}
@@ -143,44 +905,370 @@ namespace ChimeraTK { namespace history {
      */
     void addSource(DeviceModule& source, const std::string& submodule = "");
 
+    /**
+     * Add variables of a device to the ServerHistory like addSource() above, using the given history length and time
+     * stamp setting instead of the ones of the module configuration.
+     */
+    void addSource(DeviceModule& source, const std::string& submodule, const HistoryProfile& profile);
+
+    /**
+     * Add the variables of a device selected by the filter to the ServerHistory. Several subsets can be selected with
+     * several include patterns, while the model of the device is traversed only once.
+     */
+    void addSource(DeviceModule& source, const SourceFilter& filter);
+
+    /** Like addSource() above, using the given profile instead of the module configuration */
+    void addSource(DeviceModule& source, const SourceFilter& filter, const HistoryProfile& profile);
+
     void prepare() override;
     void mainLoop() override;
 
+    /** Functions to record a new sample of an input and to publish its history. One handler exists per input. */
+    struct UpdateHandler {
+      /**
+       * Record the update with the given time stamp. Returns false if the update was skipped due to the recording
+       * policy.
+       */
+      std::function<bool(uint64_t)> record;
+      /** Write the history outputs with the given VersionNumber, which is the one of the published samples */
+      std::function<void(const VersionNumber&)> publish;
+      /**
+       * Only set if the input has a queue, see HistoryProfile::queueLength. Copies the update with the given time
+       * stamp into the queue and returns false if the queue is full and the overrun policy is OverrunPolicy::block.
+       */
+      std::function<bool(uint64_t)> enqueue;
+      /** Publish the complete history, see ServerHistoryConfig::appendSize */
+      std::function<void(const VersionNumber&)> resync;
+      /** Record all queued samples, returns the number of recorded and of skipped samples */
+      std::function<std::pair<uint64_t, uint64_t>()> recordQueue;
+      bool pending{false}; ///< Samples have been recorded but not yet published
+      bool queued{false};  ///< Samples are queued but not yet recorded
+      const TransferElementAbstractor* input{nullptr}; ///< The input, used to get the VersionNumber of an update
+    };
+
     /*
      * Helper function used in tests.
-     * return Number of variables added to the history server module.
+     * return Number of variables added to the history server module (including all shards).
      */
     size_t getNumberOfVariables() { return _overallVariableList.size(); }
 
+    /*
+     * Helper function used in tests.
+     * return Number of additional internal modules, see ServerHistoryConfig::numberOfShards.
+     */
+    size_t getNumberOfShards() { return _shards.size(); }
+
+    /**
+     * Get the samples of the history of the given variable with time stamps in the range [t0, t1], using the time
+     * stamp resolution of the module. The samples are found by a binary search over the time stamps, which requires
+     * time stamps to be enabled and stored natively. This can be called from other threads, see HistoryView. Views
+     * must only be taken after all variables are added, since adding variables may move the history entries.
+     * \param name Name of the variable feeding the history, e.g. "/Dummy/out".
+     */
+    template<typename UserType>
+    HistoryView<UserType> getRange(const std::string& name, uint64_t t0, uint64_t t1) const;
+
    private:
-    void addVariableFromModel(
-        const ChimeraTK::Model::ProcessVariableProxy& pv, const RegisterPath& submodule = "", bool checkTag = true);
+    struct ShardTag {};
+
+    /**
+     * Constructor of the additional shards, which do not search the model for variables themselves. The triggers are
+     * received from the main module with the given name, and the status and export are sent to it.
+     */
+    ServerHistory(ShardTag, ModuleGroup* owner, const std::string& name, const ServerHistoryConfig& config,
+        const std::string& pvTag, const std::string& mainModuleName);
+
+    /**
+     * Name of an internal variable exchanged between the main module and the shard with the given name, relative to
+     * the main module, see ServerHistoryConfig::numberOfShards.
+     */
+    static std::string shardVariable(const std::string& shardName, const std::string& name) {
+      return "shards/" + shardName + "/" + name;
+    }
+
+    /** Create the variables of the module which do not belong to a history entry */
+    void createModuleVariables();
+
+    /**
+     * Create the export output (also of the shards) with the size of all histories added so far, see
+     * ServerHistoryConfig::exportTrigger. The export of the main module includes the histories of the shards. Called
+     * once after each call adding variables rather than per variable, since the output has to be replaced if its size
+     * changes.
+     */
+    void createExportOutput();
+
+    /**
+     * Add the variable if it matches the given submodule and filter (and has the history tag if checkTag is set). If
+     * no profile is given, it is taken from the tags of the variable, see ServerHistoryConfig::tagProfiles.
+     */
+    void addVariableFromModel(const ChimeraTK::Model::ProcessVariableProxy& pv, const RegisterPath& submodule = "",
+        bool checkTag = true, const HistoryProfile* profile = nullptr, const SourceFilter* filter = nullptr);
+
+    /**
+     * Profile of the variable with the given tags, see ServerHistoryConfig::tagProfiles. The name is only used for
+     * error messages.
+     */
+    HistoryProfile profileForTags(const std::unordered_set<std::string>& tags, const std::string& name) const;
 
+    /** Register the variable and add its history to this module or one of the shards */
     template<typename UserType>
-    void getAccessor(const std::string& variableName, const size_t& nElements);
+    void getAccessor(const std::string& variableName, const size_t& nElements, const HistoryProfile& profile,
+        const HistoryStoragePolicy& policy, const RecordingPolicy& recordingPolicy);
 
-    /** boost::fusion::map of UserTypes to std::lists containing the
+    /** Create the accessors and the history entry of the variable in this module */
+    template<typename UserType>
+    void addHistoryEntry(const std::string& variableName, const size_t& nElements, const HistoryProfile& profile,
+        const HistoryStoragePolicy& policy, const RecordingPolicy& recordingPolicy);
+
+    /** boost::fusion::map of UserTypes to std::vectors containing the
      * ArrayPushInput and ArrayOutput accessors. These accessors are dynamically
-     * created by the AccessorAttacher. */
+     * created by the AccessorAttacher. The vectors only grow while the module is constructed, where the accessors may
+     * still be moved, so the entries of one type are stored contiguously. They are not modified after prepare(), where
+     * the update handlers are built with references to the elements. */
     template<typename UserType>
-    using AccessorList = std::list<std::pair<ArrayPushInput<UserType>, HistoryEntry<UserType>>>;
+    using AccessorList = std::vector<std::pair<ArrayPushInput<UserType>, HistoryEntry<UserType>>>;
     TemplateUserTypeMapNoVoid<AccessorList> _accessorListMap;
 
-    /** boost::fusion::map of UserTypes to std::lists containing the names of the
+    /** boost::fusion::map of UserTypes to std::vectors containing the names of the
      * accessors. Technically there would be no need to use TemplateUserTypeMap
      * for this (as type does not depend on the UserType), but since these lists
      * must be filled consistently with the accessorListMap, the same construction
      * is used here. */
     template<typename UserType>
-    using NameList = std::list<std::string>;
+    using NameList = std::vector<std::string>;
     TemplateUserTypeMapNoVoid<NameList> _nameListMap;
 
+    /**
+     * boost::fusion::map of UserTypes to the recording state of the plain scalars, see ScalarHistory. The vectors are
+     * built in prepare() with their final size, since the update handlers refer to the elements.
+     */
+    template<typename UserType>
+    using ScalarHistoryList = std::vector<ScalarHistory<UserType>>;
+    TemplateUserTypeMapNoVoid<ScalarHistoryList> _scalarHistoryMap;
+
+    /** Copy the state of all scalar histories to their entries, see ScalarHistory */
+    void syncScalarHistories();
+
+    /**
+     * boost::fusion::map of UserTypes to the index of the history entries in the accessor list by variable name, used
+     * by getRange(). Indices stay valid while the accessor list grows.
+     */
+    template<typename UserType>
+    using EntryMap = std::unordered_map<std::string, size_t>;
+    TemplateUserTypeMapNoVoid<EntryMap> _entryMap;
+
+    /** Find the history entry of the variable in this module or one of the shards, nullptr if not found */
+    template<typename UserType>
+    const HistoryEntry<UserType>* findEntry(const std::string& name) const;
+
+    /**
+     * Handlers updating the history entries, one per input in the order of the accessor lists. The table is built in
+     * prepare() with its final size and not resized afterwards, so the handlers are stored contiguously and pointers
+     * to them (see _pendingHandlers) stay valid.
+     */
+    std::vector<UpdateHandler> _updateHandlers;
+
+    /** Dispatch table mapping the TransferElementID of each input to the index of its handler in _updateHandlers */
+    std::unordered_map<TransferElementID, size_t> _handlerIndex;
+
+    /** Process one update received in the main loop */
+    void handleUpdate(const TransferElementID& id);
+
+    /**
+     * Write the histories of all handlers with pending samples with the given VersionNumber. If the histories are
+     * published immediately, this is the VersionNumber of the batch, see _batchVersion.
+     */
+    void publishPending(const VersionNumber& version);
+
+    /** Write the pending histories if the publish interval has passed, see ServerHistoryConfig::publishInterval */
+    void publishIfDue();
+
+    /** Record the queued samples of the handler and publish or mark it pending */
+    void recordQueue(UpdateHandler& handler);
+
+    /** Record the queued samples of all handlers */
+    void recordQueues();
+
+    /** Publish the complete histories of all handlers, see ServerHistoryConfig::appendSize */
+    void resync();
+
+    /** Create the shared memory segment and move the ring buffers into it, see ServerHistoryConfig::sharedMemoryName */
+    void attachSharedMemory();
+
+    /** Shared memory segment, see ServerHistoryConfig::sharedMemoryName */
+    std::unique_ptr<SharedHistorySegment> _sharedSegment;
+
+    /** Fill the entries from the snapshot file, see ServerHistoryConfig::snapshotFile */
+    void loadSnapshot();
+
+    /**
+     * Write the status outputs, see ServerHistoryConfig::enableStatus. The main module includes the last status
+     * received from each shard, while the shards send their status to the main module.
+     */
+    void publishStatus();
+
+    /** Compute the memory used by the ring buffers for the status */
+    void updateRingMemory();
+
+    /** Fill the export output with the contents of all ring buffers, see ServerHistoryConfig::exportTrigger */
+    void fillExport();
+
+    /**
+     * Append the histories of the shards to the export output and write it, once all shards have sent the export with
+     * the current sequence number.
+     */
+    void completeExport();
+
+    /**
+     * Handlers with samples not yet published. If the histories are published immediately, the handlers of one batch
+     * of updates are collected, see _batchVersion.
+     */
+    std::vector<UpdateHandler*> _pendingHandlers;
+
+    /** Mark the handler as having samples not yet published */
+    void addPending(UpdateHandler& handler);
+
+    /**
+     * VersionNumber of the current batch. Updates read one after another with the same VersionNumber (e.g. all
+     * variables of a device read with the same trigger) are processed as one batch, which shares the time stamp and is
+     * published together.
+     */
+    VersionNumber _batchVersion{nullptr};
+    uint64_t _batchTimeStamp{0}; ///< Time stamp of the current batch
+
+    /** Handlers with queued samples, see HistoryProfile::queueLength */
+    std::vector<UpdateHandler*> _queuedHandlers;
+
+    ScalarPushInput<uint64_t> _publishTrigger; ///< Only used if ServerHistoryConfig::publishTrigger is set
+    TransferElementID _publishTriggerId;
+    std::chrono::steady_clock::time_point _lastPublication;
+    bool _publishImmediately{true}; ///< Neither a publish trigger nor a publish interval is used
+
+    ScalarPushInput<uint64_t> _exportTrigger; ///< Only used if ServerHistoryConfig::exportTrigger is set
+    TransferElementID _exportTriggerId;
+    ArrayOutput<uint8_t> _export;                    ///< Export blob, see ServerHistoryConfig::exportTrigger
+    size_t _exportSize{sizeof(HistoryExportHeader)}; ///< Size of the export blob, grows with each exported history
+    size_t _exportOutputSize{0};                     ///< Size of the current export output, 0 if not yet created
+    uint32_t _exportHistories{0};                    ///< Number of histories in the export blob
+    uint64_t _exportSequence{0};
+
+    ScalarPushInput<uint64_t> _captureTrigger; ///< Only used if ServerHistoryConfig::captureTrigger is set
+    TransferElementID _captureTriggerId;
+
+    ScalarPushInput<uint64_t> _resyncTrigger; ///< Only used if ServerHistoryConfig::resyncTrigger is set
+    TransferElementID _resyncTriggerId;
+    std::chrono::steady_clock::time_point _lastResync;
+
+    ServerHistoryStatus _status; ///< Only used by the main module if ServerHistoryConfig::enableStatus is set
+    std::chrono::steady_clock::time_point _lastStatusUpdate;
+    uint64_t _ringMemory{0};
+    uint64_t _outputMemory{0};
+    uint64_t _updateCount{0};
+    uint64_t _skippedCount{0};
+    uint64_t _backlogCount{0};
+    uint64_t _dataLossCount{0}; ///< Only used if ServerHistoryConfig::reportDataLoss is set
+    uint32_t _maxQueueDepth{0};
+    ProcessingTimeHistogram _processingTime;
+
     /** Overall variable name list, used to detect name collisions */
-    std::set<std::string> _overallVariableList;
+    std::unordered_set<std::string> _overallVariableList;
 
-    size_t _historyLength{1200};      ///< Length of the ring buffers used by the server history module
-    bool _enbaleTimeStamps{false};    ///< If enabled addition ring buffers for time stamps are created
-    std::string _prefix{"History"};   ///< The prefix will determine the directory where server history PVs appear
-    std::string _inputTag{"history"}; ///< The tag used to identify server history PVs
+    std::string _pvTag;          ///< Tag added to the PVs created by the ServerHistory module
+    ServerHistoryConfig _config; ///< Configuration of the module
+
+    /** Additional modules the variables are distributed to, see ServerHistoryConfig::numberOfShards */
+    std::list<ServerHistory> _shards;
+
+    std::string _mainModuleName; ///< Name of the main module, only set for shards
+
+    /**
+     * Outputs of the main module forwarding the triggers to the shards, so the triggers are only connected to the main
+     * module. The export trigger forwards the sequence number of the export.
+     */
+    ScalarOutput<uint64_t> _shardPublishTrigger;
+    ScalarOutput<uint64_t> _shardResyncTrigger;
+    ScalarOutput<uint64_t> _shardExportTrigger;
+    ScalarOutput<uint64_t> _shardCaptureTrigger;
+
+    /** Exports of the shards, received by the main module and appended to its export, see completeExport() */
+    std::vector<ArrayPushInput<uint8_t>> _shardExports;
+
+    /**
+     * Layout of the status sent by a shard to the main module. The fields are followed by the bins of the processing
+     * time histogram of the shard.
+     */
+    enum ShardStatusField : size_t {
+      shardUpdateCount,
+      shardSkippedCount,
+      shardBacklogCount,
+      shardOverrunCount,
+      shardMaxQueueDepth,
+      shardRingMemory,
+      shardOutputMemory,
+      shardStatusFields
+    };
+    ArrayOutput<uint64_t> _shardStatusOutput;         ///< Status sent by a shard
+    std::vector<ArrayPollInput<uint64_t>> _shardStatus; ///< Last status received from each shard by the main module
   };
+
+  /********************************************************************************************************************/
+
+  template<typename UserType>
+  const HistoryEntry<UserType>* ServerHistory::findEntry(const std::string& name) const {
+    const auto& entries = boost::fusion::at_key<UserType>(_entryMap.table);
+    auto it = entries.find(name);
+    if(it != entries.end()) return &boost::fusion::at_key<UserType>(_accessorListMap.table)[it->second].second;
+    for(auto& shard : _shards) {
+      if(auto* entry = shard.findEntry<UserType>(name)) return entry;
+    }
+    return nullptr;
+  }
+
+  /********************************************************************************************************************/
+
+  template<typename UserType>
+  HistoryView<UserType> ServerHistory::getRange(const std::string& name, uint64_t t0, uint64_t t1) const {
+    const auto* found = findEntry<UserType>(name);
+    if(!found) {
+      throw logic_error("ServerHistory: No history of type " + std::string(typeid(UserType).name()) +
+          " found for variable '" + name + "'.");
+    }
+    const auto& entry = *found;
+    if(!entry.withTimeStamps || entry.compactTimeStamps) {
+      throw logic_error("ServerHistory: getRange() needs native time stamps for variable '" + name + "'.");
+    }
+
+    auto historyLength = entry.historyLength;
+    while(true) {
+      auto finished = entry.writeCounter.finished.load(std::memory_order_acquire);
+      // lazily allocated rings are allocated before the first sample is finished
+      if(entry.lazyAllocation && finished == 0) return {};
+      // only the filled part of the ring is searched, the other rows have never been written
+      auto filled = std::min<uint64_t>(finished, historyLength);
+      auto oldest = (entry.cursorOffset + finished - filled) % historyLength;
+      auto timeStampAt = [&](size_t k) { return entry.timeStampRing[(oldest + k) % historyLength]; };
+      // first sample with a time stamp not less than the given one, the time stamps are sorted starting with oldest
+      auto lowerBound = [&](uint64_t t, bool inclusive) {
+        size_t begin = 0, end = filled;
+        while(begin < end) {
+          auto middle = begin + (end - begin) / 2;
+          auto timeStamp = timeStampAt(middle);
+          if(timeStamp < t || (!inclusive && timeStamp == t)) {
+            begin = middle + 1;
+          }
+          else {
+            end = middle;
+          }
+        }
+        return begin;
+      };
+      auto first = lowerBound(t0, true);
+      auto last = lowerBound(t1, false);
+      HistoryView<UserType> view(entry, (oldest + first) % historyLength, last > first ? last - first : 0,
+          static_cast<int64_t>(finished - filled + first));
+      // the time stamps might have been overwritten during the search
+      if(view.valid()) return view;
+    }
+  }
+
 }} // namespace ChimeraTK::history
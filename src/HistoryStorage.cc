@@ -0,0 +1,276 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#include "HistoryStorage.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#  include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+#include <ChimeraTK/Exception.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+namespace ChimeraTK { namespace history {
+
+  static const char persistentHistoryMagic[8] = "CTKHIST";
+
+  PersistentHistoryFile::PersistentHistoryFile(const std::string& fileName, uint32_t typeCode, size_t elementSize,
+      size_t historyLength, size_t nElements, size_t timeStampLength) {
+    auto dataSize = elementSize * historyLength * nElements;
+    // align the time stamps to 8 bytes
+    _timeStampOffset = (sizeof(PersistentHistoryHeader) + dataSize + 7) / 8 * 8;
+    _size = _timeStampOffset + timeStampLength * sizeof(uint64_t);
+
+    int fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot open persistent history file '" + fileName + "': " + std::strerror(errno));
+    }
+    // the lock is held as long as the file is open, so two histories can never use the same file
+    if(::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      ::close(fd);
+      throw ChimeraTK::logic_error(
+          "ServerHistory: Persistent history file '" + fileName + "' is already used by another history.");
+    }
+    struct stat fileStatus {};
+    if(::fstat(fd, &fileStatus) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot stat persistent history file '" + fileName + "': " + std::strerror(error));
+    }
+    bool sizeMatches = static_cast<size_t>(fileStatus.st_size) == _size;
+    if(!sizeMatches && ::ftruncate(fd, 0) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot truncate persistent history file '" + fileName + "': " + std::strerror(error));
+    }
+    if(!sizeMatches && ::ftruncate(fd, static_cast<off_t>(_size)) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot resize persistent history file '" + fileName + "': " + std::strerror(error));
+    }
+    _mapping = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(_mapping == MAP_FAILED) {
+      auto error = errno;
+      ::close(fd);
+      _mapping = nullptr;
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot map persistent history file '" + fileName + "': " + std::strerror(error));
+    }
+    _fd = fd; // kept open to hold the lock
+
+    auto& head = header();
+    _restored = sizeMatches && std::memcmp(head.magic, persistentHistoryMagic, sizeof(head.magic)) == 0 &&
+        head.formatVersion == formatVersion && head.typeCode == typeCode && head.historyLength == historyLength &&
+        head.nElements == nElements && head.timeStampLength == timeStampLength && head.cursor < historyLength &&
+        head.nSamples <= historyLength;
+    if(!_restored) {
+      if(fileStatus.st_size != 0) {
+        std::cout << "ServerHistory: Layout of persistent history file '" << fileName
+                  << "' does not match the configuration. The history is reset." << std::endl;
+      }
+      std::memset(_mapping, 0, _size);
+      std::memcpy(head.magic, persistentHistoryMagic, sizeof(head.magic));
+      head.formatVersion = formatVersion;
+      head.typeCode = typeCode;
+      head.historyLength = historyLength;
+      head.nElements = nElements;
+      head.timeStampLength = timeStampLength;
+      head.cursor = 0;
+      head.nSamples = 0;
+    }
+  }
+
+  PersistentHistoryFile::~PersistentHistoryFile() {
+    if(_mapping) {
+      ::munmap(_mapping, _size);
+    }
+    if(_fd >= 0) {
+      ::close(_fd);
+    }
+  }
+
+  SharedHistorySegment::SharedHistorySegment(const std::string& name, size_t size) : _name(name), _size(size) {
+    // Truncating a left over segment would make accesses of readers which still map it fail with SIGBUS. Unlinking
+    // it instead leaves their mapping intact, while the new segment is a new object and hence zero-filled.
+    if(::shm_unlink(name.c_str()) != 0 && errno != ENOENT) {
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot remove shared memory segment '" + name + "': " + std::strerror(errno));
+    }
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) {
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot open shared memory segment '" + name + "': " + std::strerror(errno));
+    }
+    if(::ftruncate(fd, static_cast<off_t>(_size)) != 0) {
+      auto error = errno;
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot resize shared memory segment '" + name + "': " + std::strerror(error));
+    }
+    struct stat status {};
+    if(::fstat(fd, &status) == 0) _inode = status.st_ino;
+    _mapping = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    auto error = errno;
+    ::close(fd); // the mapping stays valid
+    if(_mapping == MAP_FAILED) {
+      _mapping = nullptr;
+      ::shm_unlink(name.c_str());
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot map shared memory segment '" + name + "': " + std::strerror(error));
+    }
+  }
+
+  SharedHistorySegment::~SharedHistorySegment() {
+    if(_mapping) {
+      ::munmap(_mapping, _size);
+      // do not remove a newer segment which has replaced this one under the same name
+      int fd = ::shm_open(_name.c_str(), O_RDONLY, 0);
+      if(fd >= 0) {
+        struct stat status {};
+        bool same = ::fstat(fd, &status) == 0 && status.st_ino == _inode;
+        ::close(fd);
+        if(same) ::shm_unlink(_name.c_str());
+      }
+    }
+  }
+
+  HistorySnapshotFile::HistorySnapshotFile(const std::string& fileName) {
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if(fd < 0) {
+      if(errno == ENOENT) return; // nothing to restore yet
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot open history snapshot '" + fileName + "': " + std::strerror(errno));
+    }
+    struct stat fileStatus {};
+    if(::fstat(fd, &fileStatus) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot stat history snapshot '" + fileName + "': " + std::strerror(error));
+    }
+    _size = static_cast<size_t>(fileStatus.st_size);
+    if(_size < sizeof(HistoryExportHeader)) {
+      ::close(fd);
+      if(_size != 0) {
+        std::cout << "ServerHistory: History snapshot '" << fileName << "' is too short and is ignored." << std::endl;
+      }
+      _size = 0;
+      return;
+    }
+    _mapping = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto error = errno;
+    ::close(fd); // the mapping stays valid
+    if(_mapping == MAP_FAILED) {
+      _mapping = nullptr;
+      throw ChimeraTK::runtime_error(
+          "ServerHistory: Cannot map history snapshot '" + fileName + "': " + std::strerror(error));
+    }
+    // the file is read once from the start to the end
+    ::madvise(_mapping, _size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    const auto* begin = static_cast<const char*>(_mapping);
+    const auto& head = *static_cast<const HistoryExportHeader*>(_mapping);
+    if(std::memcmp(head.magic, "CTKHEXP", sizeof(head.magic)) != 0 ||
+        head.formatVersion != historyExportFormatVersion) {
+      std::cout << "ServerHistory: '" << fileName << "' is not a history snapshot and is ignored." << std::endl;
+      return;
+    }
+    _timeStampResolution = head.timeStampResolution;
+    _sections.reserve(head.nHistories);
+    size_t position = sizeof(HistoryExportHeader);
+    for(uint32_t n = 0; n < head.nHistories; n++) {
+      const auto* section = reinterpret_cast<const HistoryExportSection*>(begin + position);
+      if(_size - position < sizeof(HistoryExportSection) || section->sectionSize > _size - position ||
+          section->sectionSize < sizeof(HistoryExportSection) + section->nameLength || section->sectionSize % 8 != 0) {
+        std::cout << "ServerHistory: History snapshot '" << fileName << "' is truncated and is ignored." << std::endl;
+        _sections.clear();
+        return;
+      }
+      std::string_view name(begin + position + sizeof(HistoryExportSection), section->nameLength);
+      _sections.emplace(name, section);
+      position += section->sectionSize;
+    }
+  }
+
+  HistorySnapshotFile::~HistorySnapshotFile() {
+    if(_mapping) {
+      ::munmap(_mapping, _size);
+    }
+  }
+
+  const HistoryExportSection* HistorySnapshotFile::find(std::string_view name) const {
+    auto section = _sections.find(name);
+    return section == _sections.end() ? nullptr : section->second;
+  }
+
+  void CompactTimeStampBuffer::set(size_t i, uint64_t timeStamp) {
+    constexpr uint64_t maxOffset = std::numeric_limits<uint32_t>::max() - 1;
+    _offsets[i] = 0; // the entry is overwritten
+    if(timeStamp < _base || timeStamp - _base > maxOffset) {
+      // move the base to the oldest time stamp, but not further back than the new time stamp can be represented
+      auto newBase = timeStamp;
+      for(auto offset : _offsets) {
+        if(offset != 0) newBase = std::min(newBase, decode(offset));
+      }
+      newBase = std::max(newBase, timeStamp > maxOffset ? timeStamp - maxOffset : 0);
+      for(auto& offset : _offsets) {
+        if(offset == 0) continue;
+        auto value = std::max(decode(offset), newBase);
+        offset = static_cast<uint32_t>(std::min(value - newBase, maxOffset) + 1);
+      }
+      _base = newBase;
+    }
+    _offsets[i] = static_cast<uint32_t>(timeStamp - _base + 1);
+  }
+
+  void convertToFloat(const double* in, float* out, size_t n) {
+    size_t i = 0;
+#if defined(__AVX__)
+    for(; i + 4 <= n; i += 4) _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_loadu_pd(in + i)));
+#elif defined(__SSE2__)
+    for(; i + 4 <= n; i += 4) {
+      _mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(in + i)), _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2))));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; i + 4 <= n; i += 4) {
+      vst1q_f32(out + i, vcvt_high_f32_f64(vcvt_f32_f64(vld1q_f64(in + i)), vld1q_f64(in + i + 2)));
+    }
+#endif
+    for(; i < n; i++) out[i] = static_cast<float>(in[i]);
+  }
+
+  void convertToDouble(const float* in, double* out, size_t n) {
+    size_t i = 0;
+#if defined(__AVX__)
+    for(; i + 4 <= n; i += 4) _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(in + i)));
+#elif defined(__SSE2__)
+    for(; i + 4 <= n; i += 4) {
+      auto values = _mm_loadu_ps(in + i);
+      _mm_storeu_pd(out + i, _mm_cvtps_pd(values));
+      _mm_storeu_pd(out + i + 2, _mm_cvtps_pd(_mm_movehl_ps(values, values)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; i + 4 <= n; i += 4) {
+      auto values = vld1q_f32(in + i);
+      vst1q_f64(out + i, vcvt_f64_f32(vget_low_f32(values)));
+      vst1q_f64(out + i + 2, vcvt_high_f64_f32(values));
+    }
+#endif
+    for(; i < n; i++) out[i] = static_cast<double>(in[i]);
+  }
+
+}} // namespace ChimeraTK::history
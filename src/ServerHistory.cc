@@ -2,24 +2,62 @@
 // SPDX-License-Identifier: LGPL-3.0-or-later
 #include "ServerHistory.h"
 
+#include <ChimeraTK/ApplicationCore/Application.h>
 #include <ChimeraTK/ApplicationCore/ScalarAccessor.h>
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <string_view>
 
 namespace ChimeraTK { namespace history {
 
+  /** Create the configuration corresponding to the parameters of the classic constructor */
+  static ServerHistoryConfig makeConfig(
+      size_t historyLength, const std::string& historyTag, bool enableTimeStamps, const std::string& prefix) {
+    ServerHistoryConfig config;
+    config.historyLength = historyLength;
+    config.historyTag = historyTag;
+    config.enableTimeStamps = enableTimeStamps;
+    config.prefix = prefix;
+    return config;
+  }
+
   ServerHistory::ServerHistory(ModuleGroup* owner, const std::string& name, const std::string& description,
       size_t historyLength, const std::string& historyTag, bool enableTimeStamps, const std::string& prefix,
       const std::unordered_set<std::string>& tags)
-  : ApplicationModule(owner, name, description, tags), _historyLength(historyLength),
-    _enbaleTimeStamps(enableTimeStamps), _prefix(prefix), _inputTag(historyTag) {
+  : ServerHistory(owner, name, description, makeConfig(historyLength, historyTag, enableTimeStamps, prefix), tags) {}
+
+  ServerHistory::ServerHistory(ModuleGroup* owner, const std::string& name, const std::string& description,
+      const ServerHistoryConfig& config, const std::unordered_set<std::string>& tags)
+  : ApplicationModule(owner, name, description, tags), _config(config) {
+    // tag to be added to the PVs created by the ServerHistory module
+    _pvTag = getName() + "_internal";
+    // check if that tag is identical to the tag used to find ServerHistory vars
+    if(getName().compare(_config.historyTag) == 0) {
+      // In this case make sure to use a diffent tag name
+      _pvTag.append("_module");
+    }
+    if(_config.numberOfShards == 0) {
+      throw logic_error("ServerHistory: The number of shards must be at least 1.");
+    }
+    if(!_config.persistencePath.empty() && !_config.sharedMemoryName.empty()) {
+      throw logic_error("ServerHistory: Persistence cannot be combined with shared memory.");
+    }
+    createModuleVariables();
+
     auto model = dynamic_cast<ModuleGroup*>(_owner)->getModel();
     auto neighbourDir = model.visit(
         Model::returnDirectory, Model::getNeighbourDirectory, Model::returnFirstHit(Model::DirectoryProxy{}));
     std::vector<Model::ProcessVariableProxy> pvs;
     auto found = neighbourDir.visitByPath(".", [&](auto sourceDir) {
       sourceDir.visit([&](auto pv) { addVariableFromModel(pv); }, Model::breadthFirstSearch,
-          Model::keepProcessVariables && Model::keepTag(_inputTag));
+          Model::keepProcessVariables && Model::keepTag(_config.historyTag));
     });
 
     for(auto pv : pvs) {
@@ -28,6 +66,7 @@ namespace ChimeraTK { namespace history {
     if(!found) {
       throw ChimeraTK::logic_error("Path passed to BaseDAQ<TRIGGERTYPE>::addSource() not found!");
     }
+    createExportOutput();
     if(_overallVariableList.empty()) {
       std::cout << "ServerHistory module: No variables automatically added. This is ok if Device variables are added "
                    "by manually."
@@ -35,122 +74,1506 @@ namespace ChimeraTK { namespace history {
     }
   }
 
-  void ServerHistory::addVariableFromModel(
-      const Model::ProcessVariableProxy& pv, const RegisterPath& submodule, bool checkTag) {
+  ServerHistory::ServerHistory(ShardTag, ModuleGroup* owner, const std::string& name, const ServerHistoryConfig& config,
+      const std::string& pvTag, const std::string& mainModuleName)
+  : ApplicationModule(owner, name, "Shard of the ServerHistory module"), _pvTag(pvTag), _config(config),
+    _mainModuleName(mainModuleName) {
+    _config.numberOfShards = 1;
+    // the data loss counter of the application is reported by the main module only
+    _config.reportDataLoss = false;
+    // the triggers are received by the main module, which forwards them
+    std::pair<std::string*, std::string> triggers[] = {{&_config.publishTrigger, "publishTrigger"},
+        {&_config.resyncTrigger, "resyncTrigger"}, {&_config.exportTrigger, "exportTrigger"},
+        {&_config.captureTrigger, "captureTrigger"}};
+    for(auto& [trigger, forwardedName] : triggers) {
+      if(!trigger->empty()) *trigger = "../" + _mainModuleName + "/shards/" + forwardedName;
+    }
+    createModuleVariables();
+  }
+
+  void ServerHistory::createModuleVariables() {
+    if(!_config.publishTrigger.empty()) {
+      _publishTrigger = ScalarPushInput<uint64_t>{this, _config.publishTrigger, "", "Trigger to publish the history"};
+    }
+    if(_config.enableStatus && _mainModuleName.empty()) {
+      _status = ServerHistoryStatus{this, "status", "Diagnostics of the ServerHistory module", {_pvTag}};
+    }
+    else if(_config.enableStatus) {
+      // the status is sent to the main module, which publishes it together with its own status
+      _shardStatusOutput = ArrayOutput<uint64_t>{this,
+          "../" + _mainModuleName + "/" + shardVariable(getName(), "status"), "",
+          shardStatusFields + ProcessingTimeHistogram::nBins, "Status of the shard", {_pvTag}};
+    }
+    if(_config.appendSize > 0 && !_config.resyncTrigger.empty()) {
+      _resyncTrigger = ScalarPushInput<uint64_t>{this, _config.resyncTrigger, "", "Trigger to publish the history"};
+    }
+    if(!_config.exportTrigger.empty()) {
+      _exportTrigger = ScalarPushInput<uint64_t>{this, _config.exportTrigger, "", "Trigger to export the history"};
+    }
+    if(!_config.captureTrigger.empty()) {
+      _captureTrigger =
+          ScalarPushInput<uint64_t>{this, _config.captureTrigger, "", "Trigger to capture the histories"};
+    }
+    if(_config.numberOfShards > 1) {
+      // the shards read the triggers from the main module, see the constructor of the shards
+      auto forward = [&](const std::string& trigger, ScalarOutput<uint64_t>& output, const std::string& name) {
+        if(trigger.empty()) return;
+        output = ScalarOutput<uint64_t>{this, "shards/" + name, "", "Trigger forwarded to the shards", {_pvTag}};
+      };
+      forward(_config.publishTrigger, _shardPublishTrigger, "publishTrigger");
+      if(_config.appendSize > 0) forward(_config.resyncTrigger, _shardResyncTrigger, "resyncTrigger");
+      forward(_config.exportTrigger, _shardExportTrigger, "exportTrigger");
+      forward(_config.captureTrigger, _shardCaptureTrigger, "captureTrigger");
+    }
+  }
+
+  void ServerHistory::createExportOutput() {
+    if(_config.exportTrigger.empty()) return;
+    if(!_mainModuleName.empty()) {
+      if(_exportOutputSize != _exportSize) {
+        _export = ArrayOutput<uint8_t>{this, "../" + _mainModuleName + "/" + shardVariable(getName(), "export"), "",
+            _exportSize, "Export of the histories of the shard", {_pvTag}};
+        _exportOutputSize = _exportSize;
+      }
+      return;
+    }
+    // the histories of the shards follow the histories of the main module, without the header of the shard export
+    auto size = _exportSize;
+    for(auto& shard : _shards) {
+      shard.createExportOutput();
+      size += shard._exportSize - sizeof(HistoryExportHeader);
+    }
+    if(_exportOutputSize != size) {
+      _export = ArrayOutput<uint8_t>{this, "export", "", size, "Export of all histories", {_pvTag}};
+      _exportOutputSize = size;
+      _shardExports.clear();
+      _shardExports.reserve(_shards.size());
+      for(auto& shard : _shards) {
+        _shardExports.emplace_back(this, shardVariable(shard.getName(), "export"), "", shard._exportSize,
+            "Export of the histories of the shard", std::unordered_set<std::string>{_pvTag});
+      }
+    }
+  }
+
+  /**
+   * Policy of the first tag in the map the variable is tagged with, or the given default policy.
+   */
+  template<typename Policy>
+  static const Policy& policyForTags(const std::unordered_set<std::string>& tags,
+      const std::map<std::string, Policy>& tagPolicies, const Policy& defaultPolicy) {
+    if(tagPolicies.empty()) return defaultPolicy;
+    for(auto& tagPolicy : tagPolicies) {
+      if(tags.count(tagPolicy.first)) return tagPolicy.second;
+    }
+    return defaultPolicy;
+  }
+
+  HistoryProfile ServerHistory::profileForTags(
+      const std::unordered_set<std::string>& tags, const std::string& name) const {
+    // the queue settings are taken from the module configuration by the history entry unless the profile sets them
+    HistoryProfile profile{_config.historyLength, _config.enableTimeStamps};
+    profile = policyForTags(tags, _config.tagProfiles, profile);
+    // a tag like "history:5000" sets the history length
+    auto lengthTagPrefix = _config.historyTag + ":";
+    for(auto& tag : tags) {
+      if(!boost::starts_with(tag, lengthTagPrefix)) continue;
+      const auto* first = tag.data() + lengthTagPrefix.size();
+      const auto* last = tag.data() + tag.size();
+      size_t historyLength = 0;
+      auto result = std::from_chars(first, last, historyLength);
+      if(result.ec != std::errc() || result.ptr != last) {
+        throw logic_error(
+            "ServerHistory: Invalid history length in tag '" + tag + "' of variable '" + name + "'.");
+      }
+      profile.historyLength = historyLength;
+    }
+    return profile;
+  }
+
+  void ServerHistory::addVariableFromModel(const Model::ProcessVariableProxy& pv, const RegisterPath& submodule,
+      bool checkTag, const HistoryProfile* profile, const SourceFilter* filter) {
     // gather information about the PV
     auto name = pv.getFullyQualifiedPath();
     const auto& type = pv.getNodes().front().getValueType(); // All node types must be equal for a PV
     auto length = pv.getNodes().front().getNumberOfElements();
-    if(checkTag) {
-      auto tag = pv.getTags();
-      if(!tag.count(_inputTag)) return;
-    }
+    // the tags are fetched once and used for all checks and policies below
+    const auto& tags = pv.getTags();
+    if(checkTag && !tags.count(_config.historyTag)) return;
     // check if qualified path name patches the given submodule name
     if(submodule != "/" && !boost::starts_with(name, std::string(submodule) + "/")) {
       return;
     }
-
-    // check for name collision
-    if(_overallVariableList.count(name) > 0) {
-      throw logic_error("ServerHistory: Variable name '" + name + "' already taken.");
+    if(filter && !filter->matches(name)) {
+      return;
     }
 
-    // create accessor and fill lists
+    // profile and policies of the variable
+    auto variableProfile = profile ? *profile : profileForTags(tags, name);
+    const auto& policy = policyForTags(tags, _config.tagStoragePolicies, _config.storagePolicy);
+    const auto& recordingPolicy = policyForTags(tags, _config.tagRecordingPolicies, _config.recordingPolicy);
+
+    // create accessor and fill lists (name collisions are detected when registering the variable)
     callForTypeNoVoid(type, [&](auto t) {
       using UserType = decltype(t);
-      getAccessor<UserType>(name, length);
+      getAccessor<UserType>(name, length, variableProfile, policy, recordingPolicy);
     });
   }
 
   void ServerHistory::addSource(DeviceModule& source, const std::string& submodule) {
     source.getModel().visit([&](auto pv) { addVariableFromModel(pv, submodule, false); }, Model::keepPvAccess,
         Model::adjacentSearch, Model::keepProcessVariables);
+    createExportOutput();
+  }
+
+  void ServerHistory::addSource(DeviceModule& source, const std::string& submodule, const HistoryProfile& profile) {
+    source.getModel().visit([&](auto pv) { addVariableFromModel(pv, submodule, false, &profile); },
+        Model::keepPvAccess, Model::adjacentSearch, Model::keepProcessVariables);
+    createExportOutput();
+  }
+
+  void ServerHistory::addSource(DeviceModule& source, const SourceFilter& filter) {
+    source.getModel().visit([&](auto pv) { addVariableFromModel(pv, "", false, nullptr, &filter); },
+        Model::keepPvAccess, Model::adjacentSearch, Model::keepProcessVariables);
+    createExportOutput();
+  }
+
+  void ServerHistory::addSource(DeviceModule& source, const SourceFilter& filter, const HistoryProfile& profile) {
+    source.getModel().visit([&](auto pv) { addVariableFromModel(pv, "", false, &profile, &filter); },
+        Model::keepPvAccess, Model::adjacentSearch, Model::keepProcessVariables);
+    createExportOutput();
+  }
+
+  /**
+   * Compile the pattern, converting glob patterns to regular expressions, see SourceFilter::Syntax.
+   */
+  static std::regex compilePattern(const std::string& pattern, SourceFilter::Syntax syntax) {
+    std::string expression;
+    if(syntax == SourceFilter::Syntax::glob) {
+      expression.reserve(pattern.size() * 2);
+      for(size_t i = 0; i < pattern.size(); i++) {
+        auto c = pattern[i];
+        if(c == '*' && i + 1 < pattern.size() && pattern[i + 1] == '*') {
+          expression += ".*";
+          ++i;
+        }
+        else if(c == '*') {
+          expression += "[^/]*";
+        }
+        else if(c == '?') {
+          expression += "[^/]";
+        }
+        else {
+          // escape the characters with a meaning in regular expressions
+          if(std::string_view(".^$|()[]{}+\\").find(c) != std::string_view::npos) expression += '\\';
+          expression += c;
+        }
+      }
+    }
+    else {
+      expression = pattern;
+    }
+    try {
+      return std::regex(expression, std::regex::ECMAScript | std::regex::optimize);
+    }
+    catch(std::regex_error& e) {
+      throw logic_error("ServerHistory: Invalid source pattern '" + pattern + "': " + e.what());
+    }
+  }
+
+  SourceFilter& SourceFilter::include(const std::string& pattern, Syntax syntax) {
+    _include.push_back(compilePattern(pattern, syntax));
+    return *this;
+  }
+
+  SourceFilter& SourceFilter::exclude(const std::string& pattern, Syntax syntax) {
+    _exclude.push_back(compilePattern(pattern, syntax));
+    return *this;
+  }
+
+  bool SourceFilter::matches(const std::string& path) const {
+    auto matchesPath = [&](const std::regex& expression) { return std::regex_match(path, expression); };
+    return (_include.empty() || std::any_of(_include.begin(), _include.end(), matchesPath)) &&
+        std::none_of(_exclude.begin(), _exclude.end(), matchesPath);
+  }
+
+  /**
+   * Name of the persistent file of the history with the given name. The directory separators are replaced by ".",
+   * after "." and all other characters except letters, digits, "_" and "-" have been escaped as "%XX", so different
+   * histories never share a file.
+   */
+  static std::string persistentFileName(const std::string& historyName) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string fileName;
+    fileName.reserve(historyName.size() + 5);
+    for(size_t i = 1; i < historyName.size(); i++) {
+      auto c = static_cast<unsigned char>(historyName[i]);
+      if(c == '/') {
+        fileName += '.';
+      }
+      else if(std::isalnum(c) || c == '_' || c == '-') {
+        fileName += static_cast<char>(c);
+      }
+      else {
+        fileName += '%';
+        fileName += digits[c >> 4];
+        fileName += digits[c & 0xF];
+      }
+    }
+    return fileName + ".hist";
+  }
+
+  /**
+   * Use the persistent file with the given name as storage of the ring buffers of the entry.
+   */
+  template<typename UserType>
+  void attachPersistentFile(HistoryEntry<UserType>& entry, const std::string& fileName) {
+    entry.persistentFile = std::make_unique<PersistentHistoryFile>(fileName, persistentTypeCode<UserType>(),
+        sizeof(UserType), entry.historyLength, entry.nElements, entry.withTimeStamps ? entry.historyLength : 0);
+    auto& file = *entry.persistentFile;
+    entry.ring = HistoryBuffer<UserType>(static_cast<UserType*>(file.data()), entry.historyLength * entry.nElements);
+    if(entry.withTimeStamps) {
+      entry.timeStampRing = HistoryBuffer<uint64_t>(file.timeStamps(), entry.historyLength);
+    }
+    // the file is mapped anyway, so there is nothing to gain from lazy allocation
+    entry.lazyAllocation = false;
+    entry.cursor = file.header().cursor;
+    entry.restored = file.restored();
+    entry.restoredSamples = entry.restored ? file.header().nSamples : 0;
+    // like samples restored from a snapshot, the restored samples count as the first samples, see writeCounter
+    entry.cursorOffset = (entry.cursor + entry.historyLength - entry.restoredSamples) % entry.historyLength;
+    entry.writeCounter.started.store(entry.restoredSamples, std::memory_order_relaxed);
+    entry.writeCounter.finished.store(entry.restoredSamples, std::memory_order_release);
+  }
+
+  /**
+   * Helper to build the names of the outputs belonging to one history without temporary strings. The base name is
+   * kept in a buffer and the suffixes are replaced for each output.
+   */
+  class OutputName {
+   public:
+    explicit OutputName(const std::string& base) : _baseLength(base.size()) {
+      _name.reserve(_baseLength + 64);
+      _name = base;
+    }
+
+    /** Base name followed by the given suffix */
+    const std::string& operator()(const std::string& suffix) {
+      _name.resize(_baseLength);
+      _name += suffix;
+      return _name;
+    }
+
+    /** Base name followed by "_", the element index and the given suffix */
+    const std::string& operator()(size_t index, const char* suffix = "") {
+      _name.resize(_baseLength);
+      _name += '_';
+      char digits[20];
+      auto result = std::to_chars(std::begin(digits), std::end(digits), index);
+      _name.append(digits, result.ptr);
+      _name += suffix;
+      return _name;
+    }
+
+   private:
+    std::string _name;
+    size_t _baseLength;
+  };
+
+  /** Size of the section of the entry in the export blob, see HistoryExportSection */
+  template<typename UserType>
+  size_t exportSectionSize(const HistoryEntry<UserType>& entry, const std::string& name) {
+    return sizeof(HistoryExportSection) + exportPadded(name.size()) +
+        (entry.withTimeStamps ? entry.historyLength * sizeof(uint64_t) : 0) +
+        entry.nElements * exportPadded(entry.historyLength * sizeof(UserType));
   }
 
   template<typename UserType>
-  void ServerHistory::getAccessor(const std::string& variableName, const size_t& nElements) {
-    // check if variable name already registered
-    for(auto& name : _overallVariableList) {
-      if(name == variableName) {
-        throw logic_error("Cannot add '" + variableName +
-            "' to History since a variable with that "
-            "name is already registered.");
+  void ServerHistory::getAccessor(const std::string& variableName, const size_t& nElements,
+      const HistoryProfile& profile, const HistoryStoragePolicy& policy, const RecordingPolicy& recordingPolicy) {
+    if(profile.historyLength == 0) {
+      throw logic_error("ServerHistory: The history length of '" + variableName + "' must be at least 1.");
+    }
+    // register the variable name, which fails if it is already registered
+    if(!_overallVariableList.insert(variableName).second) {
+      throw logic_error("ServerHistory: Variable name '" + variableName + "' already taken.");
+    }
+
+    // distribute the variables round robin over the shards, which are created when needed
+    auto shardIndex = (_overallVariableList.size() - 1) % _config.numberOfShards;
+    if(shardIndex == 0) {
+      addHistoryEntry<UserType>(variableName, nElements, profile, policy, recordingPolicy);
+      return;
+    }
+    if(_shards.size() < shardIndex) {
+      auto shardConfig = _config;
+      if(!shardConfig.sharedMemoryName.empty()) {
+        // each shard has its own segment
+        shardConfig.sharedMemoryName += "_shard" + std::to_string(shardIndex);
+      }
+      auto shardName = getName() + "_shard" + std::to_string(shardIndex);
+      _shards.push_back(
+          ServerHistory{ShardTag{}, dynamic_cast<ModuleGroup*>(_owner), shardName, shardConfig, _pvTag, getName()});
+      if(_config.enableStatus) {
+        _shardStatus.emplace_back(this, shardVariable(shardName, "status"), "",
+            shardStatusFields + ProcessingTimeHistogram::nBins, "Status of the shard",
+            std::unordered_set<std::string>{_pvTag});
       }
     }
-    _overallVariableList.insert(variableName);
+    auto& shard = *std::next(_shards.begin(), static_cast<std::ptrdiff_t>(shardIndex - 1));
+    shard._overallVariableList.insert(variableName);
+    shard.addHistoryEntry<UserType>(variableName, nElements, profile, policy, recordingPolicy);
+  }
+
+  template<typename UserType>
+  void ServerHistory::addHistoryEntry(const std::string& variableName, const size_t& nElements,
+      const HistoryProfile& profile, const HistoryStoragePolicy& policy, const RecordingPolicy& recordingPolicy) {
+    // unit of the time stamp buffers
+    static const std::map<TimeStampResolution, std::string> timeStampUnits{{TimeStampResolution::seconds, "s"},
+        {TimeStampResolution::milliseconds, "ms"}, {TimeStampResolution::microseconds, "us"},
+        {TimeStampResolution::nanoseconds, "ns"}};
+    const auto& timeStampUnit = timeStampUnits.at(_config.timeStampResolution);
 
     // generate name as visible in the History
-    std::string historyName = RegisterPath(_prefix) / variableName;
+    std::string historyName = RegisterPath(_config.prefix) / variableName;
     // add accessor and name to lists
     auto& tmpList = boost::fusion::at_key<UserType>(_accessorListMap.table);
     auto& nameList = boost::fusion::at_key<UserType>(_nameListMap.table);
-    // tag to be added to the PVs created by the ServerHistory module
-    std::string serverHistoryPVTag = getName();
-    serverHistoryPVTag.append("_internal");
-    // check if that tag is identical to the tag used to find ServerHistory vars
-    if(getName().compare(_inputTag) == 0) {
-      // In this case make sure to use a diffent tag name
-      serverHistoryPVTag.append("_module");
+    const auto& serverHistoryPVTag = _pvTag;
+    tmpList.emplace_back(std::piecewise_construct,
+        std::forward_as_tuple(ArrayPushInput<UserType>{this, variableName, "", nElements, "", {serverHistoryPVTag}}),
+        std::forward_as_tuple(HistoryEntry<UserType>{_config, nElements, profile, policy, recordingPolicy}));
+    auto& entry = tmpList.back().second;
+    if(!_config.persistencePath.empty() && (entry.coding != SampleCoding::native || entry.compactTimeStamps)) {
+      throw logic_error(
+          "ServerHistory: Compact storage of '" + variableName + "' cannot be combined with persistence.");
     }
-    if(nElements == 1) {
-      tmpList.emplace_back(std::piecewise_construct,
-          std::forward_as_tuple(ArrayPushInput<UserType>{this, variableName, "", 1, "", {serverHistoryPVTag}}),
-          std::forward_as_tuple(HistoryEntry<UserType>{_enbaleTimeStamps}));
-
-      // in case of a scalar history only use the variableName
-      tmpList.back().second.data.emplace_back(
-          ArrayOutput<UserType>{this, historyName, "", _historyLength, "", {serverHistoryPVTag}});
-      if(_enbaleTimeStamps) {
-        tmpList.back().second.timeStamp.emplace_back(ArrayOutput<uint64_t>{this, historyName + "_timeStamps",
-            "Time stamps for entries in the history buffer", _historyLength, "", {serverHistoryPVTag}});
+    if constexpr(std::is_trivially_copyable<UserType>::value) {
+      if(entry.inSharedMemory && (entry.coding != SampleCoding::native || entry.compactTimeStamps)) {
+        throw logic_error(
+            "ServerHistory: Compact storage of '" + variableName + "' cannot be combined with shared memory.");
+      }
+      if(!_config.persistencePath.empty()) {
+        attachPersistentFile(entry, _config.persistencePath + "/" + persistentFileName(historyName));
+      }
+    }
+    OutputName outputName(historyName);
+    if(nElements == 1 || _config.arrayAsMatrix) {
+      // in case of a scalar or matrix history only use the variableName
+      entry.data.reserve(1);
+      entry.data.emplace_back(
+          ArrayOutput<UserType>{this, historyName, "", entry.historyLength * nElements, "", {serverHistoryPVTag}});
+      if(entry.withTimeStamps) {
+        entry.timeStamp.reserve(1);
+        entry.timeStamp.emplace_back(ArrayOutput<uint64_t>{this, outputName("_timeStamps"), timeStampUnit,
+            entry.historyLength, "Time stamps for entries in the history buffer", {serverHistoryPVTag}});
       }
     }
     else {
-      tmpList.emplace_back(std::piecewise_construct,
-          std::forward_as_tuple(ArrayPushInput<UserType>{this, variableName, "", nElements, "", {serverHistoryPVTag}}),
-          std::forward_as_tuple(HistoryEntry<UserType>{_enbaleTimeStamps}));
-
+      entry.data.reserve(nElements);
+      if(entry.withTimeStamps) {
+        entry.timeStamp.reserve(_config.sharedTimeStamps ? 1 : nElements);
+      }
       for(size_t i = 0; i < nElements; i++) {
         // in case of an array history append the index to the variableName
-        tmpList.back().second.data.emplace_back(ArrayOutput<UserType>{
-            this, historyName + "_" + std::to_string(i), "", _historyLength, "", {serverHistoryPVTag}});
-        if(_enbaleTimeStamps) {
-          tmpList.back().second.timeStamp.emplace_back(
-              ArrayOutput<uint64_t>{this, historyName + "_" + std::to_string(i) + "_timeStamps",
-                  "Time stamps for entries in the history buffer", _historyLength, "", {serverHistoryPVTag}});
+        entry.data.emplace_back(ArrayOutput<UserType>{
+            this, outputName(i), "", entry.historyLength, "", {serverHistoryPVTag}});
+        if(entry.withTimeStamps && !_config.sharedTimeStamps) {
+          entry.timeStamp.emplace_back(ArrayOutput<uint64_t>{this, outputName(i, "_timeStamps"), timeStampUnit,
+              entry.historyLength, "Time stamps for entries in the history buffer", {serverHistoryPVTag}});
         }
       }
+      if(entry.withTimeStamps && _config.sharedTimeStamps) {
+        // one time stamp buffer for all elements of the input
+        entry.timeStamp.emplace_back(ArrayOutput<uint64_t>{this, outputName("_timeStamps"), timeStampUnit,
+            entry.historyLength, "Time stamps for entries in the history buffers", {serverHistoryPVTag}});
+      }
+    }
+    if constexpr(std::is_arithmetic<UserType>::value) {
+      entry.decimation.reserve(_config.decimationStages.size());
+      for(auto& stage : _config.decimationStages) {
+        if(stage.factor == 0 || stage.historyLength == 0) {
+          throw logic_error("ServerHistory: Invalid configuration of decimation stage '" + stage.name + "'.");
+        }
+        entry.decimation.emplace_back(stage, nElements, entry.withTimeStamps);
+        auto& decimation = entry.decimation.back();
+        OutputName stageName(outputName("_" + stage.name));
+        decimation.mean = ArrayOutput<double>{this, stageName("_mean"), "", stage.historyLength * nElements,
+            "Mean of decimated history", {serverHistoryPVTag}};
+        decimation.min = ArrayOutput<UserType>{this, stageName("_min"), "", stage.historyLength * nElements,
+            "Minimum of decimated history", {serverHistoryPVTag}};
+        decimation.max = ArrayOutput<UserType>{this, stageName("_max"), "", stage.historyLength * nElements,
+            "Maximum of decimated history", {serverHistoryPVTag}};
+        if(entry.withTimeStamps) {
+          decimation.timeStamp = ArrayOutput<uint64_t>{this, stageName("_timeStamps"), timeStampUnit,
+              stage.historyLength, "Time stamps for entries in the decimated history buffer", {serverHistoryPVTag}};
+        }
+      }
+    }
+    if(entry.withStatistics) {
+      entry.windowMean = ArrayOutput<double>{
+          this, outputName("_mean"), "", nElements, "Mean of the history buffer", {serverHistoryPVTag}};
+      entry.windowRms = ArrayOutput<double>{
+          this, outputName("_rms"), "", nElements, "RMS of the history buffer", {serverHistoryPVTag}};
+      entry.windowMin = ArrayOutput<UserType>{
+          this, outputName("_min"), "", nElements, "Minimum of the history buffer", {serverHistoryPVTag}};
+      entry.windowMax = ArrayOutput<UserType>{
+          this, outputName("_max"), "", nElements, "Maximum of the history buffer", {serverHistoryPVTag}};
+    }
+    if(entry.appendSize > 0) {
+      entry.append = ArrayOutput<UserType>{this, outputName("_append"), "", entry.appendSize * nElements,
+          "Samples recorded since the previous publication", {serverHistoryPVTag}};
+      if(entry.withTimeStamps) {
+        entry.appendTimeStamps = ArrayOutput<uint64_t>{this, outputName("_append_timeStamps"), timeStampUnit,
+            entry.appendSize, "Time stamps of the samples in the append output", {serverHistoryPVTag}};
+      }
+      entry.sequence = ScalarOutput<uint64_t>{
+          this, outputName("_sequence"), "", "Number of samples recorded since the start", {serverHistoryPVTag}};
     }
+    if(!_config.captureTrigger.empty()) {
+      entry.captureLength = _config.capturePreSamples + _config.capturePostSamples;
+      if(entry.captureLength == 0 || entry.captureLength > entry.historyLength) {
+        throw logic_error("ServerHistory: The capture window of '" + variableName +
+            "' must hold at least one sample and not more than the history length.");
+      }
+      entry.capture = ArrayOutput<UserType>{this, outputName("_capture"), "", entry.captureLength * nElements,
+          "Samples around the last capture trigger", {serverHistoryPVTag}};
+      if(entry.withTimeStamps) {
+        entry.captureTimeStamps = ArrayOutput<uint64_t>{this, outputName("_capture_timeStamps"), timeStampUnit,
+            entry.captureLength, "Time stamps of the samples in the capture output", {serverHistoryPVTag}};
+      }
+    }
+    if(entry.withGapMarkers) {
+      entry.dropped = ArrayOutput<uint32_t>{this, outputName("_dropped"), "", entry.historyLength,
+          "Number of samples dropped before the entries in the history buffer", {serverHistoryPVTag}};
+    }
+    if(_config.enableStatus && _config.enableVariableStatus) {
+      entry.updateCountOutput = ScalarOutput<uint64_t>{this, outputName("_updateCount"), "",
+          "Number of samples recorded in the history buffer", {serverHistoryPVTag}};
+      if(entry.withGapMarkers) {
+        entry.overrunCountOutput = ScalarOutput<uint64_t>{this, outputName("_overrunCount"), "",
+            "Number of samples dropped due to a full input queue", {serverHistoryPVTag}};
+      }
+      if(entry.recordingMode != RecordingMode::always) {
+        entry.skippedCountOutput = ScalarOutput<uint64_t>{this, outputName("_skippedCount"), "",
+            "Number of updates not recorded due to the recording policy", {serverHistoryPVTag}};
+      }
+    }
+    if(_config.publishRawRing) {
+      entry.head = ScalarOutput<uint32_t>{
+          this, outputName("_head"), "", "Index of the oldest entry in the history buffer", {serverHistoryPVTag}};
+    }
+    // the rings of plain scalars are allocated here and not mapped to a file or shared memory, and no capture or queue
+    // is used, so recording a sample needs no checks
+    entry.plainScalar = _config.scalarFastPath && nElements == 1 && entry.coding == SampleCoding::native &&
+        !entry.compactTimeStamps && entry.recordingMode == RecordingMode::always && !entry.withStatistics &&
+        entry.decimation.empty() && entry.queueLength == 0 && !entry.lazyAllocation && !entry.inSharedMemory &&
+        !entry.persistentFile && _config.captureTrigger.empty();
+    if(!entry.lazyAllocation) entry.allocateRings();
     nameList.push_back(variableName);
+    boost::fusion::at_key<UserType>(_entryMap.table)[variableName] = tmpList.size() - 1;
+    if constexpr(std::is_trivially_copyable<UserType>::value) {
+      if(!_config.exportTrigger.empty()) {
+        // the output is created when all variables of the call are added, see createExportOutput()
+        _exportSize += exportSectionSize(entry, variableName);
+        ++_exportHistories;
+      }
+    }
+  }
+
+  /**
+   * Call f(ring, coding) with the data ring buffer used by the sample coding of the entry and the matching coding.
+   */
+  template<typename UserType, typename F>
+  void visitRing(HistoryEntry<UserType>& entry, F&& f) {
+    if constexpr(std::is_arithmetic<UserType>::value) {
+      if(entry.coding == SampleCoding::float32) {
+        f(entry.floatRing, Float32Coding<UserType>{});
+        return;
+      }
+      if(entry.coding == SampleCoding::quantised) {
+        f(entry.quantisedRing, QuantisedCoding<UserType>{entry.quantisationStep});
+        return;
+      }
+    }
+    if constexpr(std::is_same<UserType, std::string>::value) {
+      if(entry.coding == SampleCoding::stringSlots) {
+        f(entry.stringRing, StringSlotCoding{});
+        return;
+      }
+    }
+    f(entry.ring, NativeCoding<UserType>{});
+  }
+
+  /**
+   * Copy element i of all samples in the ring into the given output, starting with the oldest sample.
+   */
+  template<typename OutputType, typename RingType, typename Coding = NativeCoding<OutputType>>
+  void linearise(ArrayOutput<OutputType>& output, const RingType& ring, size_t cursor, size_t nElements, size_t i,
+      const Coding& coding = {}) {
+    auto out = output.begin();
+    for(size_t k = cursor * nElements + i; k < ring.size(); k += nElements) *(out++) = coding.decode(ring[k]);
+    for(size_t k = i; k < cursor * nElements; k += nElements) *(out++) = coding.decode(ring[k]);
+  }
+
+  /**
+   * Copy complete samples of the ring into the given output, starting with the oldest sample. This is used if
+   * the output holds all elements (scalars and matrix histories) and results in two contiguous copies.
+   */
+  template<typename OutputType, typename RingType, typename Coding = NativeCoding<OutputType>>
+  void lineariseRows(ArrayOutput<OutputType>& output, const RingType& ring, size_t cursor, size_t nElements,
+      const Coding& coding = {}) {
+    auto split = cursor * nElements;
+    decodeRow(coding, ring.data() + split, output.data(), ring.size() - split);
+    decodeRow(coding, ring.data(), output.data() + ring.size() - split, split);
+  }
+
+  /** Overload of lineariseRows() for the string slots, which do not provide iterators */
+  template<typename Coding>
+  void lineariseRows(ArrayOutput<std::string>& output, const StringSlotBuffer& ring, size_t cursor, size_t nElements,
+      const Coding& coding) {
+    auto out = output.begin();
+    for(size_t k = cursor * nElements; k < ring.size(); k++) *(out++) = coding.decode(ring[k]);
+    for(size_t k = 0; k < cursor * nElements; k++) *(out++) = coding.decode(ring[k]);
+  }
+
+  /**
+   * Convert the time of the given VersionNumber into a time stamp with the given resolution.
+   */
+  static uint64_t toTimeStamp(const VersionNumber& version, TimeStampResolution resolution) {
+    auto sinceEpoch = version.getTime().time_since_epoch();
+    switch(resolution) {
+      case TimeStampResolution::seconds:
+        return std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch).count();
+      case TimeStampResolution::milliseconds:
+        return std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count();
+      case TimeStampResolution::microseconds:
+        return std::chrono::duration_cast<std::chrono::microseconds>(sinceEpoch).count();
+      case TimeStampResolution::nanoseconds:
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch).count();
+    }
+    return 0;
+  }
+
+  /**
+   * Write the output with the given VersionNumber. The accessors of ApplicationCore write with the current
+   * VersionNumber of the module, which already belongs to the next batch once it has been read, see
+   * ServerHistory::publishPending().
+   */
+  template<typename Output>
+  void writeWithVersion(Output& output, const VersionNumber& version) {
+    if(static_cast<TransferElementAbstractor&>(output).write(version)) {
+      Application::incrementDataLossCounter(output.getName());
+    }
+  }
+
+  /**
+   * Add one entry to the decimation stage with the given index. The entry is given by iterators to the mean, minimum
+   * and maximum of all elements. If the current bin of the stage is complete, it is added to the ring buffer of the
+   * stage and passed on to the next stage.
+   */
+  template<typename UserType, typename MeanIterator, typename MinMaxIterator>
+  void decimate(std::vector<DecimationEntry<UserType>>& stages, size_t index, MeanIterator mean, MinMaxIterator min,
+      MinMaxIterator max, uint64_t timeStamp) {
+    auto& stage = stages[index];
+    auto nElements = stage.sum.size();
+    if(stage.count == 0) {
+      std::copy(min, min + nElements, stage.binMin.begin());
+      std::copy(max, max + nElements, stage.binMax.begin());
+      std::fill(stage.sum.begin(), stage.sum.end(), 0.);
+    }
+    for(size_t i = 0; i < nElements; i++) {
+      stage.sum[i] += static_cast<double>(mean[i]);
+      stage.binMin[i] = std::min(stage.binMin[i], static_cast<UserType>(min[i]));
+      stage.binMax[i] = std::max(stage.binMax[i], static_cast<UserType>(max[i]));
+    }
+    if(++stage.count < stage.factor) return;
+
+    // the bin is complete: store it in the ring
+    auto offset = stage.cursor * nElements;
+    for(size_t i = 0; i < nElements; i++) stage.meanRing[offset + i] = stage.sum[i] / static_cast<double>(stage.count);
+    std::copy(stage.binMin.begin(), stage.binMin.end(), stage.minRing.begin() + offset);
+    std::copy(stage.binMax.begin(), stage.binMax.end(), stage.maxRing.begin() + offset);
+    if(!stage.timeStampRing.empty()) stage.timeStampRing[stage.cursor] = timeStamp;
+    stage.cursor = (stage.cursor + 1) % stage.historyLength;
+    stage.count = 0;
+    stage.unpublished = true;
+
+    if(index + 1 < stages.size()) {
+      decimate(stages, index + 1, stage.meanRing.cbegin() + offset, stage.minRing.cbegin() + offset,
+          stage.maxRing.cbegin() + offset, timeStamp);
+    }
+  }
+
+  /**
+   * Publish the decimation stage if it received new entries since the last publication.
+   */
+  template<typename UserType>
+  void publishDecimation(DecimationEntry<UserType>& stage, size_t nElements, const VersionNumber& version) {
+    if(!stage.unpublished) return;
+    lineariseRows(stage.mean, stage.meanRing, stage.cursor, nElements);
+    writeWithVersion(stage.mean, version);
+    lineariseRows(stage.min, stage.minRing, stage.cursor, nElements);
+    writeWithVersion(stage.min, version);
+    lineariseRows(stage.max, stage.maxRing, stage.cursor, nElements);
+    writeWithVersion(stage.max, version);
+    if(!stage.timeStampRing.empty()) {
+      lineariseRows(stage.timeStamp, stage.timeStampRing, stage.cursor, 1);
+      writeWithVersion(stage.timeStamp, version);
+    }
+    stage.unpublished = false;
+  }
+
+  /**
+   * Check whether the sample has to be recorded according to the recording mode of the entry.
+   */
+  template<typename UserType>
+  bool isSignificant(const UserType* sample, const HistoryEntry<UserType>& entry) {
+    if(entry.recordingMode == RecordingMode::always || !entry.hasRecorded) return true;
+    if constexpr(std::is_arithmetic<UserType>::value) {
+      if(entry.recordingMode != RecordingMode::changeOnly) {
+        bool relative = entry.recordingMode == RecordingMode::relativeDeadband;
+        for(size_t i = 0; i < entry.nElements; i++) {
+          auto last = static_cast<double>(entry.lastRecorded[i]);
+          auto limit = relative ? entry.deadband * std::abs(last) : entry.deadband;
+          // written such that NaN counts as change
+          if(!(std::abs(static_cast<double>(sample[i]) - last) <= limit)) return true;
+        }
+        return false;
+      }
+    }
+    return !std::equal(sample, sample + entry.nElements, entry.lastRecorded.begin());
+  }
+
+  /**
+   * Copy the newest captureLength samples into the capture outputs, see ServerHistoryConfig::captureTrigger. The
+   * outputs are written with the next publication of the entry, see writeCapture().
+   */
+  template<typename UserType>
+  void freezeCapture(HistoryEntry<UserType>& entry) {
+    entry.capturePending = true;
+    if(!entry.allocated) return; // nothing recorded yet
+    auto nElements = entry.nElements;
+    auto historyLength = entry.historyLength;
+    auto first = (entry.cursor + historyLength - entry.captureLength) % historyLength;
+    visitRing(entry, [&](const auto& ring, const auto& coding) {
+      for(size_t k = 0; k < entry.captureLength; k++) {
+        auto offset = ((first + k) % historyLength) * nElements;
+        for(size_t i = 0; i < nElements; i++) entry.capture[k * nElements + i] = coding.decode(ring[offset + i]);
+      }
+    });
+    if(entry.withTimeStamps) {
+      for(size_t k = 0; k < entry.captureLength; k++) {
+        auto row = (first + k) % historyLength;
+        entry.captureTimeStamps[k] =
+            entry.compactTimeStamps ? entry.compactTimeStampRing[row] : entry.timeStampRing[row];
+      }
+    }
+  }
+
+  /** Write the capture outputs if they hold a new capture, see freezeCapture() */
+  template<typename UserType>
+  void writeCapture(HistoryEntry<UserType>& entry, const VersionNumber& version) {
+    if(!entry.capturePending) return;
+    writeWithVersion(entry.capture, version);
+    if(entry.withTimeStamps) writeWithVersion(entry.captureTimeStamps, version);
+    entry.capturePending = false;
+  }
+
+  /**
+   * Record the value of a plain scalar, see ScalarHistory. Same as recordSample(), but without the element loops, the
+   * dispatch over the sample codings, the recording mode and the optional features. The time stamp setting is a
+   * template parameter, so the update handler (see AddUpdateHandler) selects the variant when it is built.
+   */
+  template<bool withTimeStamps, typename UserType>
+  void recordScalar(ScalarHistory<UserType>& history, const UserType& value, uint64_t timeStamp) {
+    auto& writeCounter = *history.writeCounter;
+    auto sampleNumber = writeCounter.finished.load(std::memory_order_relaxed);
+    writeCounter.started.store(sampleNumber + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto cursor = history.cursor;
+    history.ring[cursor] = value;
+    if constexpr(withTimeStamps) history.timeStampRing[cursor] = timeStamp;
+    ++cursor;
+    history.cursor = cursor == history.historyLength ? 0 : cursor;
+    history.unpublished += history.unpublished < history.historyLength;
+    ++history.updateCount;
+    writeCounter.finished.store(sampleNumber + 1, std::memory_order_release);
+  }
+
+  /** Copy the cursor and the counters of the scalar history to its entry, see ScalarHistory */
+  template<typename UserType>
+  void syncEntry(const ScalarHistory<UserType>& history) {
+    auto& entry = *history.entry;
+    entry.cursor = history.cursor;
+    entry.unpublished = history.unpublished;
+    entry.updateCount = history.updateCount;
+  }
+
+  /**
+   * Record the sample with the given time stamp (only used if time stamps are enabled) in the history entry. The
+   * outputs are not written, see publishHistory(). Returns false if the update was skipped due to the recording mode of
+   * the entry.
+   */
+  template<typename UserType>
+  bool recordSample(HistoryEntry<UserType>& entry, const UserType* sample, uint64_t timeStamp) {
+    if(!isSignificant(sample, entry)) {
+      ++entry.skippedCount;
+      return false;
+    }
+    if(!entry.allocated) entry.allocateRings();
+    if(entry.recordingMode != RecordingMode::always) {
+      std::copy(sample, sample + entry.nElements, entry.lastRecorded.begin());
+      entry.hasRecorded = true;
+    }
+    // announce the write to readers in other threads, see HistoryView
+    auto sampleNumber = entry.writeCounter.finished.load(std::memory_order_relaxed);
+    entry.writeCounter.started.store(sampleNumber + 1, std::memory_order_relaxed);
+    if(entry.shared) entry.shared->started.store(sampleNumber + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // insert the new sample at the cursor position, which holds the oldest sample
+    auto cursor = entry.cursor;
+    auto nElements = entry.nElements;
+    visitRing(entry, [&](auto& ring, const auto& coding) {
+      auto offset = cursor * nElements;
+      if constexpr(std::is_arithmetic<UserType>::value) {
+        if(entry.withStatistics) {
+          // the statistics are computed from the stored values, so removing overwritten samples is exact
+          auto& statistics = entry.statistics;
+          for(size_t i = 0; i < nElements; i++) {
+            UserType removed = coding.decode(ring[offset + i]);
+            ring[offset + i] = coding.encode(sample[i]);
+            statistics.update(i, coding.decode(ring[offset + i]), removed);
+          }
+          if(statistics.nextSample()) {
+            // correct the rounding errors accumulated in the sums
+            auto historyLength = entry.historyLength;
+            auto first = cursor + 1 + historyLength - statistics.count();
+            statistics.recompute(statistics.count(), [&](size_t k, size_t i) -> UserType {
+              return coding.decode(ring[((first + k) % historyLength) * nElements + i]);
+            });
+          }
+          return;
+        }
+      }
+      if constexpr(std::is_same<std::decay_t<decltype(ring)>, StringSlotBuffer>::value) {
+        for(size_t i = 0; i < nElements; i++) ring[offset + i] = coding.encode(sample[i]);
+      }
+      else {
+        // copy or convert the complete row in one pass
+        encodeRow(coding, sample, ring.begin() + offset, nElements);
+      }
+    });
+    if(entry.withTimeStamps) {
+      if(entry.compactTimeStamps) {
+        entry.compactTimeStampRing.set(cursor, timeStamp);
+      }
+      else {
+        entry.timeStampRing[cursor] = timeStamp;
+      }
+    }
+    if(entry.withGapMarkers) {
+      entry.droppedRing[cursor] =
+          static_cast<uint32_t>(std::min<uint64_t>(entry.pendingDropped, std::numeric_limits<uint32_t>::max()));
+      entry.pendingDropped = 0;
+    }
+    entry.cursor = (cursor + 1) % entry.historyLength;
+    entry.unpublished = std::min(entry.unpublished + 1, entry.historyLength);
+    ++entry.updateCount;
+    entry.writeCounter.finished.store(sampleNumber + 1, std::memory_order_release);
+    if(entry.shared) entry.shared->finished.store(sampleNumber + 1, std::memory_order_release);
+    if(entry.persistentFile) entry.persistentFile->advance(entry.cursor);
+
+    if constexpr(std::is_arithmetic<UserType>::value) {
+      if(!entry.decimation.empty()) {
+        // use the sample rather than the ring buffer, which might hold it with reduced precision
+        decimate(entry.decimation, 0, sample, sample, sample, timeStamp);
+      }
+    }
+    if(entry.captureRemaining > 0 && --entry.captureRemaining == 0) freezeCapture(entry);
+    return true;
+  }
+
+  /**
+   * Copy the current value of the input with the given time stamp into the queue of the entry, applying the overrun
+   * policy if the queue is full. Returns false if the queue is full and the policy is OverrunPolicy::block.
+   */
+  template<typename UserType>
+  bool enqueueSample(ArrayPushInput<UserType>& input, HistoryEntry<UserType>& entry, uint64_t timeStamp) {
+    auto capacity = entry.queueLength;
+    size_t index;
+    uint32_t dropped = 0;
+    if(entry.queueSize < capacity) {
+      index = (entry.queueFirst + entry.queueSize) % capacity;
+      ++entry.queueSize;
+    }
+    else if(entry.overrunPolicy == OverrunPolicy::block) {
+      return false;
+    }
+    else {
+      ++entry.overrunCount;
+      if(entry.overrunPolicy == OverrunPolicy::dropOldest) {
+        // the dropped sample is counted at the sample following it
+        auto carry = entry.queueDropped[entry.queueFirst] + 1;
+        entry.queueFirst = (entry.queueFirst + 1) % capacity;
+        if(capacity > 1) {
+          entry.queueDropped[entry.queueFirst] += carry;
+        }
+        else {
+          dropped = carry;
+        }
+      }
+      else {
+        dropped = entry.queueDropped[(entry.queueFirst + capacity - 1) % capacity] + 1;
+      }
+      // both policies store the update as newest sample
+      index = (entry.queueFirst + capacity - 1) % capacity;
+    }
+    std::copy(input.begin(), input.end(), entry.queue.begin() + index * entry.nElements);
+    entry.queueTimeStamps[index] = timeStamp;
+    entry.queueDropped[index] = dropped;
+    return true;
+  }
+
+  /**
+   * Record all queued samples of the entry, starting with the oldest. Returns the number of recorded and of skipped
+   * samples.
+   */
+  template<typename UserType>
+  std::pair<uint64_t, uint64_t> recordQueuedSamples(HistoryEntry<UserType>& entry) {
+    uint64_t recorded = 0;
+    auto total = entry.queueSize;
+    for(; entry.queueSize > 0; --entry.queueSize) {
+      auto index = entry.queueFirst;
+      entry.queueFirst = (index + 1) % entry.queueLength;
+      entry.pendingDropped += entry.queueDropped[index];
+      if(recordSample(entry, entry.queue.data() + index * entry.nElements, entry.queueTimeStamps[index])) {
+        ++recorded;
+      }
+    }
+    return {recorded, total - recorded};
+  }
+
+  /**
+   * Fill the statistics outputs of the entry, see ServerHistoryConfig::enableStatistics.
+   */
+  template<typename UserType>
+  void updateStatisticsOutputs(HistoryEntry<UserType>& entry) {
+    if constexpr(std::is_arithmetic<UserType>::value) {
+      if(entry.withStatistics) {
+        for(size_t i = 0; i < entry.nElements; i++) {
+          entry.windowMean[i] = entry.statistics.mean(i);
+          entry.windowRms[i] = entry.statistics.rms(i);
+          entry.windowMin[i] = entry.statistics.min(i);
+          entry.windowMax[i] = entry.statistics.max(i);
+        }
+      }
+    }
+  }
+
+  /**
+   * Fill the history outputs of the entry with all samples recorded since the last publication, without writing them.
+   */
+  template<typename UserType>
+  void updateOutputs(HistoryEntry<UserType>& entry) {
+    auto nElements = entry.nElements;
+    auto historyLength = entry.historyLength;
+    // ring index of the first sample not yet published
+    auto first = (entry.cursor + historyLength - entry.unpublished) % historyLength;
+
+    visitRing(entry, [&](const auto& ring, const auto& coding) {
+      if(nElements == 1 || entry.matrix) {
+        // one output holding all elements
+        auto& data = entry.data.front();
+        if(entry.publishRawRing) {
+          // only the new samples have changed in the raw ring
+          for(size_t k = 0; k < entry.unpublished; k++) {
+            auto offset = ((first + k) % historyLength) * nElements;
+            for(size_t i = 0; i < nElements; i++) data[offset + i] = coding.decode(ring[offset + i]);
+          }
+        }
+        else {
+          lineariseRows(data, ring, entry.cursor, nElements, coding);
+        }
+      }
+      else {
+        for(size_t i = 0; i < nElements; i++) {
+          auto& data = entry.data[i];
+          if(entry.publishRawRing) {
+            for(size_t k = 0; k < entry.unpublished; k++) {
+              auto row = (first + k) % historyLength;
+              data[row] = coding.decode(ring[row * nElements + i]);
+            }
+          }
+          else {
+            linearise(data, ring, entry.cursor, nElements, i, coding);
+          }
+        }
+      }
+    });
+
+    for(auto& timeStamp : entry.timeStamp) {
+      if(entry.publishRawRing) {
+        for(size_t k = 0; k < entry.unpublished; k++) {
+          auto row = (first + k) % historyLength;
+          timeStamp[row] = entry.compactTimeStamps ? entry.compactTimeStampRing[row] : entry.timeStampRing[row];
+        }
+      }
+      else if(entry.compactTimeStamps) {
+        // the buffer itself decodes the stored offsets
+        lineariseRows(timeStamp, entry.compactTimeStampRing, entry.cursor, 1, entry.compactTimeStampRing);
+      }
+      else {
+        lineariseRows(timeStamp, entry.timeStampRing, entry.cursor, 1);
+      }
+    }
+    if(entry.withGapMarkers) {
+      if(entry.publishRawRing) {
+        for(size_t k = 0; k < entry.unpublished; k++) {
+          auto row = (first + k) % historyLength;
+          entry.dropped[row] = entry.droppedRing[row];
+        }
+      }
+      else {
+        lineariseRows(entry.dropped, entry.droppedRing, entry.cursor, 1);
+      }
+    }
+    updateStatisticsOutputs(entry);
+    if(entry.publishRawRing) {
+      entry.head = entry.cursor;
+    }
+    entry.unpublished = 0;
+  }
+
+  /**
+   * Write the samples recorded since the last publication into the append outputs of the entry, see
+   * ServerHistoryConfig::appendSize.
+   */
+  template<typename UserType>
+  void publishAppend(HistoryEntry<UserType>& entry, const VersionNumber& version) {
+    auto nElements = entry.nElements;
+    auto historyLength = entry.historyLength;
+    auto first = (entry.cursor + historyLength - entry.unpublished) % historyLength;
+    visitRing(entry, [&](const auto& ring, const auto& coding) {
+      for(size_t k = 0; k < entry.unpublished; k++) {
+        auto offset = ((first + k) % historyLength) * nElements;
+        for(size_t i = 0; i < nElements; i++) entry.append[k * nElements + i] = coding.decode(ring[offset + i]);
+      }
+    });
+    writeWithVersion(entry.append, version);
+    if(entry.withTimeStamps) {
+      for(size_t k = 0; k < entry.unpublished; k++) {
+        auto row = (first + k) % historyLength;
+        entry.appendTimeStamps[k] =
+            entry.compactTimeStamps ? entry.compactTimeStampRing[row] : entry.timeStampRing[row];
+      }
+      writeWithVersion(entry.appendTimeStamps, version);
+    }
+    updateStatisticsOutputs(entry);
+    entry.unpublished = 0;
+  }
+
+  /**
+   * Write the history outputs of the entry, containing all samples recorded since the last publication.
+   */
+  template<typename UserType>
+  void publishHistory(HistoryEntry<UserType>& entry, const VersionNumber& version) {
+    if(entry.appendSize > 0 && !entry.resyncPending && entry.unpublished <= entry.appendSize &&
+        entry.unpublished < entry.historyLength) {
+      publishAppend(entry, version);
+    }
+    else {
+      if(entry.appendSize > 0) {
+        // the published outputs are not up to date, e.g. in raw ring order, so all samples have to be updated
+        entry.unpublished = entry.historyLength;
+        entry.resyncPending = false;
+      }
+      updateOutputs(entry);
+      for(auto& data : entry.data) writeWithVersion(data, version);
+      for(auto& timeStamp : entry.timeStamp) writeWithVersion(timeStamp, version);
+      if(entry.withGapMarkers) writeWithVersion(entry.dropped, version);
+      if(entry.publishRawRing) writeWithVersion(entry.head, version);
+    }
+    if(entry.appendSize > 0) {
+      entry.sequence = entry.updateCount;
+      writeWithVersion(entry.sequence, version);
+    }
+    for(auto& stage : entry.decimation) publishDecimation(stage, entry.nElements, version);
+    writeCapture(entry, version);
+    if(entry.withStatistics) {
+      writeWithVersion(entry.windowMean, version);
+      writeWithVersion(entry.windowRms, version);
+      writeWithVersion(entry.windowMin, version);
+      writeWithVersion(entry.windowMax, version);
+    }
   }
 
-  struct Update {
-    Update(TransferElementID id) : _id(id) {}
+  /**
+   * Publish the entry of the scalar history, see publishHistory(). The cursor and the counters are copied to the entry
+   * first, and the number of unpublished samples is taken back afterwards.
+   */
+  template<typename UserType>
+  void publishScalarHistory(ScalarHistory<UserType>& history, const VersionNumber& version) {
+    syncEntry(history);
+    publishHistory(*history.entry, version);
+    history.unpublished = history.entry->unpublished;
+  }
+
+  /**
+   * Functor used with boost::fusion::for_each to start a capture of all entries, see
+   * ServerHistoryConfig::captureTrigger. Without post-trigger samples the capture is complete immediately.
+   */
+  struct StartCapture {
+    StartCapture(size_t postSamples, const VersionNumber& version) : _postSamples(postSamples), _version(version) {}
 
     template<typename PAIR>
     void operator()(PAIR& pair) const {
-      auto& accessorList = pair.second;
-      for(auto accessor = accessorList.begin(); accessor != accessorList.end(); ++accessor) {
-        if(accessor->first.getId() == _id) {
-          for(size_t i = 0; i < accessor->first.getNElements(); i++) {
-            std::rotate(accessor->second.data.at(i).begin(), accessor->second.data.at(i).begin() + 1,
-                accessor->second.data.at(i).end());
-            *(accessor->second.data.at(i).end() - 1) = accessor->first[i];
-            accessor->second.data.at(i).write();
-            if(accessor->second.withTimeStamps) {
-              std::rotate(accessor->second.timeStamp.at(i).begin(), accessor->second.timeStamp.at(i).begin() + 1,
-                  accessor->second.timeStamp.at(i).end());
-              *(accessor->second.timeStamp.at(i).end() - 1) =
-                  std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
-                      .count();
-              accessor->second.timeStamp.at(i).write();
-            }
+      for(auto& accessor : pair.second) {
+        auto& entry = accessor.second;
+        if(entry.captureRemaining > 0) continue; // the running capture is kept
+        if(_postSamples == 0) {
+          freezeCapture(entry);
+          writeCapture(entry, _version);
+        }
+        else {
+          entry.captureRemaining = _postSamples;
+        }
+      }
+    }
+
+    size_t _postSamples;
+    VersionNumber _version;
+  };
+
+  /** Functor used with boost::fusion::for_each to fill the outputs of restored entries before the initial write. */
+  struct RestoreOutputs {
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      for(auto& accessor : pair.second) {
+        auto& entry = accessor.second;
+        if(!entry.restored) continue;
+        if constexpr(std::is_arithmetic<typename PAIR::first_type>::value) {
+          if(entry.withStatistics) {
+            // add the restored samples to the statistics, starting with the oldest; rows not restored are skipped
+            visitRing(entry, [&](const auto& ring, const auto& coding) {
+              for(size_t k = entry.historyLength - entry.restoredSamples; k < entry.historyLength; k++) {
+                auto offset = ((entry.cursor + k) % entry.historyLength) * entry.nElements;
+                for(size_t i = 0; i < entry.nElements; i++) {
+                  auto value = coding.decode(ring[offset + i]);
+                  entry.statistics.update(i, value, value);
+                }
+                entry.statistics.nextSample();
+              }
+            });
           }
         }
+        entry.unpublished = entry.historyLength;
+        updateOutputs(entry);
+      }
+    }
+  };
+
+  /**
+   * Write the section of the entry into the export blob at the given position, see HistoryExportSection. Returns the
+   * position after the section.
+   */
+  template<typename UserType>
+  uint8_t* exportSection(HistoryEntry<UserType>& entry, const std::string& name, uint8_t* out) {
+    auto sectionSize = exportSectionSize(entry, name);
+    // zeros for the padding and for rings which are not yet allocated
+    std::fill(out, out + sectionSize, 0);
+    HistoryExportSection section{sectionSize, persistentTypeCode<UserType>(), static_cast<uint32_t>(name.size()),
+        entry.nElements, entry.historyLength, entry.withTimeStamps ? 1U : 0U, 0};
+    std::memcpy(out, &section, sizeof(section));
+    auto* position = out + sizeof(section);
+    std::memcpy(position, name.data(), name.size());
+    position += exportPadded(name.size());
+    if(!entry.allocated) return out + sectionSize;
+
+    auto historyLength = entry.historyLength;
+    if(entry.withTimeStamps) {
+      auto row = entry.cursor;
+      for(size_t k = 0; k < historyLength; k++) {
+        uint64_t timeStamp = entry.compactTimeStamps ? entry.compactTimeStampRing[row] : entry.timeStampRing[row];
+        std::memcpy(position + k * sizeof(uint64_t), &timeStamp, sizeof(timeStamp));
+        if(++row == historyLength) row = 0;
+      }
+      position += historyLength * sizeof(uint64_t);
+    }
+    visitRing(entry, [&](const auto& ring, const auto& coding) {
+      auto nElements = entry.nElements;
+      auto columnSize = exportPadded(historyLength * sizeof(UserType));
+      for(size_t i = 0; i < nElements; i++) {
+        auto* column = position + i * columnSize;
+        auto row = entry.cursor;
+        for(size_t k = 0; k < historyLength; k++) {
+          UserType value = coding.decode(ring[row * nElements + i]);
+          std::memcpy(column + k * sizeof(UserType), &value, sizeof(UserType));
+          if(++row == historyLength) row = 0;
+        }
+      }
+    });
+    return out + sectionSize;
+  }
+
+  /** Functor used with boost::fusion::for_each to write the sections of all exported entries into the export blob. */
+  template<typename NameMap>
+  struct ExportEntries {
+    ExportEntries(const NameMap& names, uint8_t*& position) : _names(names), _position(position) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      if constexpr(std::is_trivially_copyable<UserType>::value) {
+        // the name list is filled consistently with the accessor list
+        auto name = boost::fusion::at_key<UserType>(_names.table).begin();
+        for(auto& accessor : pair.second) {
+          _position = exportSection(accessor.second, *name, _position);
+          ++name;
+        }
       }
     }
 
-    TransferElementID _id;
+    const NameMap& _names;
+    uint8_t*& _position;
+  };
+
+  /**
+   * Fill the ring buffers of the entry from its section of a snapshot, see HistorySnapshotFile. If the snapshot holds
+   * more samples than the history length, only the newest ones are used. Returns false if the layout of the section
+   * does not match the entry.
+   */
+  template<typename UserType>
+  bool loadSnapshotSection(HistoryEntry<UserType>& entry, const HistoryExportSection& section, bool withTimeStamps) {
+    auto columnSize = exportPadded(section.nSamples * sizeof(UserType));
+    auto expectedSize = sizeof(HistoryExportSection) + exportPadded(section.nameLength) +
+        (section.timeStamps ? section.nSamples * sizeof(uint64_t) : 0) + section.nElements * columnSize;
+    if(section.typeCode != persistentTypeCode<UserType>() || section.nElements != entry.nElements ||
+        section.sectionSize != expectedSize || section.nSamples == 0) {
+      return false;
+    }
+    if(!entry.allocated) entry.allocateRings();
+
+    auto* position =
+        reinterpret_cast<const uint8_t*>(&section) + sizeof(HistoryExportSection) + exportPadded(section.nameLength);
+    auto nSamples = std::min<size_t>(section.nSamples, entry.historyLength);
+    auto first = section.nSamples - nSamples; // index of the oldest used sample in the snapshot
+    if(section.timeStamps) {
+      if(withTimeStamps && entry.withTimeStamps) {
+        for(size_t k = 0; k < nSamples; k++) {
+          uint64_t timeStamp;
+          std::memcpy(&timeStamp, position + (first + k) * sizeof(uint64_t), sizeof(timeStamp));
+          if(entry.compactTimeStamps) {
+            entry.compactTimeStampRing.set(k, timeStamp);
+          }
+          else {
+            entry.timeStampRing[k] = timeStamp;
+          }
+        }
+      }
+      position += section.nSamples * sizeof(uint64_t);
+    }
+    visitRing(entry, [&](auto& ring, const auto& coding) {
+      auto nElements = entry.nElements;
+      for(size_t i = 0; i < nElements; i++) {
+        auto* column = position + i * columnSize + first * sizeof(UserType);
+        for(size_t k = 0; k < nSamples; k++) {
+          UserType value;
+          std::memcpy(&value, column + k * sizeof(UserType), sizeof(UserType));
+          ring[k * nElements + i] = coding.encode(value);
+        }
+      }
+    });
+    // The restored samples count as samples 0 to nSamples-1, so sample n is in row n % historyLength as described at
+    // SharedHistoryEntryHeader, and readers (see HistoryView) see them as completely written.
+    entry.cursor = nSamples % entry.historyLength;
+    entry.cursorOffset = 0;
+    entry.writeCounter.started.store(nSamples, std::memory_order_relaxed);
+    entry.writeCounter.finished.store(nSamples, std::memory_order_release);
+    if(entry.shared) {
+      entry.shared->started.store(nSamples, std::memory_order_relaxed);
+      entry.shared->finished.store(nSamples, std::memory_order_release);
+    }
+    if(entry.persistentFile) {
+      entry.persistentFile->header().cursor = entry.cursor;
+      entry.persistentFile->header().nSamples = nSamples;
+    }
+    entry.restored = true;
+    entry.restoredSamples = nSamples;
+    return true;
+  }
+
+  /** Functor used with boost::fusion::for_each to fill the entries from a snapshot, see loadSnapshotSection(). */
+  template<typename NameMap>
+  struct LoadSnapshot {
+    LoadSnapshot(const NameMap& names, const HistorySnapshotFile& snapshot, bool withTimeStamps)
+    : _names(names), _snapshot(snapshot), _withTimeStamps(withTimeStamps) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      if constexpr(std::is_trivially_copyable<UserType>::value) {
+        auto name = boost::fusion::at_key<UserType>(_names.table).begin();
+        for(auto& accessor : pair.second) {
+          auto& entry = accessor.second;
+          // histories restored from their persistent file are more recent than the snapshot
+          const auto* section = entry.restored ? nullptr : _snapshot.find(*name);
+          if(section && !loadSnapshotSection(entry, *section, _withTimeStamps)) {
+            std::cout << "ServerHistory: Layout of '" << *name
+                      << "' in the history snapshot does not match the configuration. It is not restored." << std::endl;
+          }
+          ++name;
+        }
+      }
+    }
+
+    const NameMap& _names;
+    const HistorySnapshotFile& _snapshot;
+    bool _withTimeStamps;
+  };
+
+  /** Size of the entry in the shared memory segment, see SharedHistoryEntryHeader */
+  template<typename UserType>
+  size_t sharedEntrySize(const HistoryEntry<UserType>& entry, const std::string& name) {
+    return sizeof(SharedHistoryEntryHeader) + exportPadded(name.size()) +
+        exportPadded(entry.historyLength * entry.nElements * sizeof(UserType)) +
+        (entry.withTimeStamps ? entry.historyLength * sizeof(uint64_t) : 0);
+  }
+
+  /**
+   * Lay out the entry in the shared memory segment at the given position and use the segment as storage of its ring
+   * buffers. Returns the position after the entry.
+   */
+  template<typename UserType>
+  char* attachSharedEntry(HistoryEntry<UserType>& entry, const std::string& name, char* position) {
+    auto* header = new(position) SharedHistoryEntryHeader();
+    auto dataOffset = sizeof(SharedHistoryEntryHeader) + exportPadded(name.size());
+    auto dataSize = entry.historyLength * entry.nElements;
+    header->entrySize = sharedEntrySize(entry, name);
+    header->typeCode = persistentTypeCode<UserType>();
+    header->nameLength = static_cast<uint32_t>(name.size());
+    header->nElements = entry.nElements;
+    header->historyLength = entry.historyLength;
+    header->dataOffset = dataOffset;
+    std::memcpy(position + sizeof(SharedHistoryEntryHeader), name.data(), name.size());
+    entry.ring = HistoryBuffer<UserType>(reinterpret_cast<UserType*>(position + dataOffset), dataSize);
+    if(entry.withTimeStamps) {
+      header->timeStampOffset = dataOffset + exportPadded(dataSize * sizeof(UserType));
+      entry.timeStampRing = HistoryBuffer<uint64_t>(
+          reinterpret_cast<uint64_t*>(position + header->timeStampOffset), entry.historyLength);
+    }
+    entry.shared = header;
+    return position + header->entrySize;
+  }
+
+  /** Functor used with boost::fusion::for_each to compute the size of the shared memory segment. */
+  template<typename NameMap>
+  struct AddSharedMemorySize {
+    AddSharedMemorySize(const NameMap& names, size_t& size, uint32_t& nHistories)
+    : _names(names), _size(size), _nHistories(nHistories) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      if constexpr(std::is_trivially_copyable<UserType>::value) {
+        auto name = boost::fusion::at_key<UserType>(_names.table).begin();
+        for(auto& accessor : pair.second) {
+          if(accessor.second.inSharedMemory) {
+            _size += sharedEntrySize(accessor.second, *name);
+            ++_nHistories;
+          }
+          ++name;
+        }
+      }
+    }
+
+    const NameMap& _names;
+    size_t& _size;
+    uint32_t& _nHistories;
+  };
+
+  /** Functor used with boost::fusion::for_each to lay out all entries in the shared memory segment. */
+  template<typename NameMap>
+  struct AttachSharedMemory {
+    AttachSharedMemory(const NameMap& names, char*& position) : _names(names), _position(position) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      if constexpr(std::is_trivially_copyable<UserType>::value) {
+        auto name = boost::fusion::at_key<UserType>(_names.table).begin();
+        for(auto& accessor : pair.second) {
+          if(accessor.second.inSharedMemory) _position = attachSharedEntry(accessor.second, *name, _position);
+          ++name;
+        }
+      }
+    }
+
+    const NameMap& _names;
+    char*& _position;
+  };
+
+  /**
+   * Functor used with boost::fusion::for_each to fill the dispatch table with one update handler per input. The
+   * recording state of the plain scalars is created in the given map, see ScalarHistory.
+   */
+  template<typename ScalarHistoryMap>
+  struct AddUpdateHandler {
+    AddUpdateHandler(std::vector<ServerHistory::UpdateHandler>& updateHandlers,
+        std::unordered_map<TransferElementID, size_t>& handlerIndex, ScalarHistoryMap& scalarHistories)
+    : _updateHandlers(updateHandlers), _handlerIndex(handlerIndex), _scalarHistories(scalarHistories) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      auto& scalarHistories = boost::fusion::at_key<UserType>(_scalarHistories.table);
+      scalarHistories.clear();
+      // the vector must not be reallocated after the first handler refers to it
+      scalarHistories.reserve(static_cast<size_t>(std::count_if(
+          pair.second.begin(), pair.second.end(), [](const auto& accessor) { return accessor.second.plainScalar; })));
+      for(auto& accessor : pair.second) {
+        // the accessor lists are not modified after prepare(), so the references stay valid
+        _handlerIndex[accessor.first.getId()] = _updateHandlers.size();
+        auto& handler = _updateHandlers.emplace_back();
+        handler.input = &accessor.first;
+        auto& entry = accessor.second;
+        if(entry.plainScalar) {
+          auto& history = scalarHistories.emplace_back(ScalarHistory<UserType>{entry.ring.data(),
+              entry.withTimeStamps ? entry.timeStampRing.data() : nullptr, &entry.writeCounter, entry.historyLength,
+              entry.cursor, entry.unpublished, entry.updateCount, &entry});
+          if(entry.withTimeStamps) {
+            handler.record = [&accessor, &history](uint64_t timeStamp) {
+              recordScalar<true>(history, accessor.first[0], timeStamp);
+              return true;
+            };
+          }
+          else {
+            handler.record = [&accessor, &history](uint64_t timeStamp) {
+              recordScalar<false>(history, accessor.first[0], timeStamp);
+              return true;
+            };
+          }
+          handler.publish = [&history](const VersionNumber& version) { publishScalarHistory(history, version); };
+          handler.resync = [&history](const VersionNumber& version) {
+            history.entry->resyncPending = true;
+            publishScalarHistory(history, version);
+          };
+          continue;
+        }
+        handler.record = [&accessor](uint64_t timeStamp) {
+          return recordSample(accessor.second, accessor.first.data(), timeStamp);
+        };
+        handler.publish = [&accessor](const VersionNumber& version) { publishHistory(accessor.second, version); };
+        handler.resync = [&accessor](const VersionNumber& version) {
+          accessor.second.resyncPending = true;
+          publishHistory(accessor.second, version);
+        };
+        if(accessor.second.queueLength > 0) {
+          handler.enqueue = [&accessor](uint64_t timeStamp) {
+            return enqueueSample(accessor.first, accessor.second, timeStamp);
+          };
+          handler.recordQueue = [&accessor] { return recordQueuedSamples(accessor.second); };
+        }
+      }
+    }
+
+    std::vector<ServerHistory::UpdateHandler>& _updateHandlers;
+    std::unordered_map<TransferElementID, size_t>& _handlerIndex;
+    ScalarHistoryMap& _scalarHistories;
+  };
+
+  /** Functor used with boost::fusion::for_each to copy the state of all scalar histories to their entries. */
+  struct SyncScalarHistories {
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      for(auto& history : pair.second) syncEntry(history);
+    }
+  };
+
+  /** Functor used with boost::fusion::for_each to sum up the memory used by the ring buffers. */
+  struct AddRingMemory {
+    AddRingMemory(uint64_t& ringMemory) : _ringMemory(ringMemory) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      for(auto& accessor : pair.second) {
+        auto& entry = accessor.second;
+        visitRing(entry, [this](auto& ring, const auto&) { _ringMemory += ring.memorySize(); });
+        _ringMemory += entry.timeStampRing.memorySize() + entry.compactTimeStampRing.size() * sizeof(uint32_t) +
+            entry.droppedRing.memorySize();
+        for(auto& stage : entry.decimation) {
+          _ringMemory += stage.meanRing.size() * sizeof(double) +
+              (stage.minRing.size() + stage.maxRing.size()) * sizeof(UserType) +
+              stage.timeStampRing.size() * sizeof(uint64_t);
+        }
+      }
+    }
+
+    uint64_t& _ringMemory;
+  };
+
+  /**
+   * Functor used with boost::fusion::for_each to sum up the memory used by the values of the outputs holding complete
+   * histories. Only the buffer of the application side is counted.
+   */
+  struct AddOutputMemory {
+    AddOutputMemory(uint64_t& outputMemory) : _outputMemory(outputMemory) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      using UserType = typename PAIR::first_type;
+      for(auto& accessor : pair.second) {
+        auto& entry = accessor.second;
+        for(auto& output : entry.data) _outputMemory += output.getNElements() * sizeof(UserType);
+        for(auto& output : entry.timeStamp) _outputMemory += output.getNElements() * sizeof(uint64_t);
+        for(auto& stage : entry.decimation) {
+          _outputMemory += stage.mean.getNElements() * sizeof(double) +
+              (stage.min.getNElements() + stage.max.getNElements()) * sizeof(UserType);
+          if(entry.withTimeStamps) _outputMemory += stage.timeStamp.getNElements() * sizeof(uint64_t);
+        }
+        if(entry.captureLength > 0) {
+          _outputMemory += entry.capture.getNElements() * sizeof(UserType);
+          if(entry.withTimeStamps) _outputMemory += entry.captureTimeStamps.getNElements() * sizeof(uint64_t);
+        }
+        if(entry.withGapMarkers) _outputMemory += entry.dropped.getNElements() * sizeof(uint32_t);
+      }
+    }
+
+    uint64_t& _outputMemory;
+  };
+
+  /** Functor used with boost::fusion::for_each to sum up the samples dropped due to full queues. */
+  struct AddOverruns {
+    AddOverruns(uint64_t& overrunCount) : _overrunCount(overrunCount) {}
+
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      for(auto& accessor : pair.second) _overrunCount += accessor.second.overrunCount;
+    }
+
+    uint64_t& _overrunCount;
+  };
+
+  /** Functor used with boost::fusion::for_each to write the per variable status outputs. */
+  struct PublishVariableStatus {
+    template<typename PAIR>
+    void operator()(PAIR& pair) const {
+      for(auto& accessor : pair.second) {
+        auto& entry = accessor.second;
+        entry.updateCountOutput = entry.updateCount;
+        entry.updateCountOutput.write();
+        if(entry.recordingMode != RecordingMode::always) {
+          entry.skippedCountOutput = entry.skippedCount;
+          entry.skippedCountOutput.write();
+        }
+        if(entry.withGapMarkers) {
+          entry.overrunCountOutput = entry.overrunCount;
+          entry.overrunCountOutput.write();
+        }
+      }
+    }
   };
 
   void ServerHistory::prepare() {
@@ -158,6 +1581,57 @@ namespace ChimeraTK { namespace history {
       throw logic_error(
           "No variables are connected to the ServerHistory module. Did you use the correct tag or connect a Device?");
     }
+    if(!_config.sharedMemoryName.empty()) {
+      attachSharedMemory();
+    }
+    if(!_config.snapshotFile.empty()) {
+      loadSnapshot();
+    }
+    boost::fusion::for_each(_accessorListMap.table, RestoreOutputs());
+
+    // The TransferElementIDs are only known after the connection phase, so the dispatch table is built here. The
+    // scalar histories take the state of the restored entries.
+    _updateHandlers.clear();
+    _handlerIndex.clear();
+    // the table must not be reallocated after the first handler is added, see _updateHandlers
+    _updateHandlers.reserve(getNumberOfVariables());
+    _handlerIndex.reserve(getNumberOfVariables());
+    boost::fusion::for_each(
+        _accessorListMap.table, AddUpdateHandler(_updateHandlers, _handlerIndex, _scalarHistoryMap));
+    _pendingHandlers.clear();
+    _pendingHandlers.reserve(_updateHandlers.size());
+    _queuedHandlers.clear();
+    _queuedHandlers.reserve(_updateHandlers.size());
+    if(!_config.publishTrigger.empty()) {
+      _publishTriggerId = _publishTrigger.getId();
+    }
+    if(!_config.exportTrigger.empty()) {
+      _exportTriggerId = _exportTrigger.getId();
+    }
+    if(_config.appendSize > 0 && !_config.resyncTrigger.empty()) {
+      _resyncTriggerId = _resyncTrigger.getId();
+    }
+    if(!_config.captureTrigger.empty()) {
+      _captureTriggerId = _captureTrigger.getId();
+    }
+    _publishImmediately = _config.publishTrigger.empty() && _config.publishInterval.count() == 0;
+    if(_config.enableStatus) {
+      updateRingMemory();
+      // the outputs are complete at this point and do not change later
+      uint64_t outputMemory = 0;
+      boost::fusion::for_each(_accessorListMap.table, AddOutputMemory(outputMemory));
+      _outputMemory = outputMemory;
+      if(_mainModuleName.empty()) {
+        // the shards are included with the first status update
+        _status.ringMemory = _ringMemory;
+        _status.outputMemory = _outputMemory;
+      }
+    }
+    if(!_config.exportTrigger.empty()) {
+      // the initial value holds the restored histories
+      fillExport();
+    }
+
     incrementDataFaultCounter(); // the written data is flagged as faulty
     writeAll();                  // send out initial values of all outputs.
     decrementDataFaultCounter(); // when entering the main loop calculate the validity from the inputs. No artificial increase.
@@ -165,10 +1639,304 @@ namespace ChimeraTK { namespace history {
 
   void ServerHistory::mainLoop() {
     auto group = readAnyGroup();
+    _lastPublication = std::chrono::steady_clock::now();
+    _lastStatusUpdate = _lastPublication;
+    _lastResync = _lastPublication;
+    // the initial values of the shard exports have been received, which hold the restored histories
+    if(!_shardExports.empty()) completeExport();
     while(true) {
       auto id = group.readAny();
-      boost::fusion::for_each(_accessorListMap.table, Update(id));
+      // process all updates already queued before waiting again
+      uint32_t queueDepth = 0;
+      while(id.isValid()) {
+        if(_config.enableStatus) {
+          auto start = std::chrono::steady_clock::now();
+          handleUpdate(id);
+          _processingTime.add(std::chrono::steady_clock::now() - start);
+        }
+        else {
+          handleUpdate(id);
+        }
+        ++queueDepth;
+        id = group.readAnyNonBlocking();
+      }
+      // the burst is complete
+      if(!_queuedHandlers.empty()) recordQueues();
+      if(_publishImmediately) {
+        publishPending(_batchVersion);
+      }
+      else {
+        publishIfDue();
+      }
+      if(_config.appendSize > 0 && _config.resyncInterval.count() > 0 &&
+          std::chrono::steady_clock::now() - _lastResync >= _config.resyncInterval) {
+        resync();
+      }
+      if(_config.enableStatus) {
+        _backlogCount += queueDepth - 1;
+        _maxQueueDepth = std::max(_maxQueueDepth, queueDepth);
+        if(std::chrono::steady_clock::now() - _lastStatusUpdate >= _config.statusInterval) {
+          publishStatus();
+        }
+      }
+    }
+  }
+
+  /** Forward the value of the trigger to the shards, see ServerHistoryConfig::numberOfShards */
+  static void forwardTrigger(const ScalarPushInput<uint64_t>& trigger, ScalarOutput<uint64_t>& forwarded) {
+    forwarded = static_cast<uint64_t>(trigger);
+    forwarded.write();
+  }
+
+  void ServerHistory::handleUpdate(const TransferElementID& id) {
+    if(id == _publishTriggerId) {
+      recordQueues();
+      publishPending(getCurrentVersionNumber());
+      if(!_shards.empty()) forwardTrigger(_publishTrigger, _shardPublishTrigger);
+      return;
+    }
+    if(id == _resyncTriggerId) {
+      resync();
+      if(!_shards.empty()) forwardTrigger(_resyncTrigger, _shardResyncTrigger);
+      return;
+    }
+    if(id == _exportTriggerId) {
+      recordQueues();
+      // the shards use the sequence number of the main module, so their exports can be matched
+      _exportSequence = _mainModuleName.empty() ? _exportSequence + 1 : static_cast<uint64_t>(_exportTrigger);
+      fillExport();
+      if(_shards.empty()) {
+        _export.write();
+        return;
+      }
+      // the export is written once all shards have sent their histories, see completeExport()
+      _shardExportTrigger = _exportSequence;
+      _shardExportTrigger.write();
+      return;
+    }
+    if(id == _captureTriggerId) {
+      // queued samples have been received before the trigger
+      recordQueues();
+      boost::fusion::for_each(
+          _accessorListMap.table, StartCapture(_config.capturePostSamples, getCurrentVersionNumber()));
+      if(!_shards.empty()) forwardTrigger(_captureTrigger, _shardCaptureTrigger);
+      return;
+    }
+    auto index = _handlerIndex.find(id);
+    if(index == _handlerIndex.end()) {
+      // the only other inputs are the exports of the shards
+      completeExport();
+      return;
+    }
+    auto& handler = _updateHandlers[index->second];
+    auto version = handler.input->getVersionNumber();
+    if(version != _batchVersion) {
+      // a new batch starts, so the histories of the previous batch are complete
+      if(_publishImmediately) publishPending(_batchVersion);
+      _batchVersion = version;
+      // all elements share the time stamp, which is taken from the input rather than from the system clock
+      _batchTimeStamp = toTimeStamp(version, _config.timeStampResolution);
+    }
+    if(handler.enqueue) {
+      if(!handler.enqueue(_batchTimeStamp)) {
+        // the queue is full and the policy does not allow to drop samples
+        recordQueue(handler);
+        handler.enqueue(_batchTimeStamp);
+      }
+      if(!handler.queued) {
+        handler.queued = true;
+        _queuedHandlers.push_back(&handler);
+      }
+      return;
+    }
+    if(handler.record(_batchTimeStamp)) {
+      ++_updateCount;
+      addPending(handler);
+    }
+    else {
+      ++_skippedCount;
+    }
+    publishIfDue();
+  }
+
+  void ServerHistory::publishIfDue() {
+    if(_config.publishInterval.count() > 0 &&
+        std::chrono::steady_clock::now() - _lastPublication >= _config.publishInterval) {
+      publishPending(getCurrentVersionNumber());
+    }
+  }
+
+  void ServerHistory::recordQueue(UpdateHandler& handler) {
+    auto [recorded, skipped] = handler.recordQueue();
+    _updateCount += recorded;
+    _skippedCount += skipped;
+    if(recorded > 0) addPending(handler);
+  }
+
+  void ServerHistory::addPending(UpdateHandler& handler) {
+    if(!handler.pending) {
+      handler.pending = true;
+      _pendingHandlers.push_back(&handler);
+    }
+  }
+
+  void ServerHistory::recordQueues() {
+    for(auto* handler : _queuedHandlers) {
+      recordQueue(*handler);
+      handler->queued = false;
+    }
+    _queuedHandlers.clear();
+  }
+
+  void ServerHistory::updateRingMemory() {
+    uint64_t ringMemory = 0;
+    boost::fusion::for_each(_accessorListMap.table, AddRingMemory(ringMemory));
+    _ringMemory = ringMemory;
+  }
+
+  void ServerHistory::publishStatus() {
+    uint64_t overrunCount = 0;
+    boost::fusion::for_each(_accessorListMap.table, AddOverruns(overrunCount));
+    // with lazy allocation the memory grows with the number of updated variables
+    updateRingMemory();
+    if(!_mainModuleName.empty()) {
+      _shardStatusOutput[shardUpdateCount] = _updateCount;
+      _shardStatusOutput[shardSkippedCount] = _skippedCount;
+      _shardStatusOutput[shardBacklogCount] = _backlogCount;
+      _shardStatusOutput[shardOverrunCount] = overrunCount;
+      _shardStatusOutput[shardMaxQueueDepth] = _maxQueueDepth;
+      _shardStatusOutput[shardRingMemory] = _ringMemory;
+      _shardStatusOutput[shardOutputMemory] = _outputMemory;
+      const auto& bins = _processingTime.bins();
+      std::copy(bins.begin(), bins.end(), _shardStatusOutput.begin() + shardStatusFields);
+      _shardStatusOutput.write();
+    }
+    else {
+      uint64_t updateCount = _updateCount;
+      uint64_t skippedCount = _skippedCount;
+      uint64_t backlogCount = _backlogCount;
+      uint64_t maxQueueDepth = _maxQueueDepth;
+      uint64_t ringMemory = _ringMemory;
+      uint64_t outputMemory = _outputMemory;
+      auto processingTime = _processingTime;
+      for(auto& shardStatus : _shardStatus) {
+        shardStatus.readLatest();
+        updateCount += shardStatus[shardUpdateCount];
+        skippedCount += shardStatus[shardSkippedCount];
+        backlogCount += shardStatus[shardBacklogCount];
+        overrunCount += shardStatus[shardOverrunCount];
+        maxQueueDepth = std::max(maxQueueDepth, static_cast<uint64_t>(shardStatus[shardMaxQueueDepth]));
+        ringMemory += shardStatus[shardRingMemory];
+        outputMemory += shardStatus[shardOutputMemory];
+        processingTime.addBins(shardStatus.data() + shardStatusFields);
+      }
+      _status.updateCount = updateCount;
+      _status.skippedCount = skippedCount;
+      _status.backlogCount = backlogCount;
+      _status.maxQueueDepth = static_cast<uint32_t>(maxQueueDepth);
+      _status.overrunCount = overrunCount;
+      _status.processingTimeP50 = processingTime.quantile(0.5);
+      _status.processingTimeP99 = processingTime.quantile(0.99);
+      _status.updateCount.write();
+      _status.skippedCount.write();
+      _status.backlogCount.write();
+      _status.overrunCount.write();
+      if(_config.reportDataLoss) {
+        _dataLossCount += Application::getAndResetDataLossCounter();
+        _status.dataLossCount = _dataLossCount;
+        _status.dataLossCount.write();
+      }
+      _status.maxQueueDepth.write();
+      _status.processingTimeP50.write();
+      _status.processingTimeP99.write();
+      _status.ringMemory = ringMemory;
+      _status.ringMemory.write();
+      if(!_shardStatus.empty()) {
+        _status.outputMemory = outputMemory;
+        _status.outputMemory.write();
+      }
+    }
+    if(_config.enableVariableStatus) {
+      syncScalarHistories();
+      boost::fusion::for_each(_accessorListMap.table, PublishVariableStatus());
+    }
+    // the maximum and the processing times refer to the last status interval
+    _maxQueueDepth = 0;
+    _processingTime.reset();
+    _lastStatusUpdate = std::chrono::steady_clock::now();
+  }
+
+  void ServerHistory::resync() {
+    recordQueues();
+    for(auto& handler : _updateHandlers) handler.resync(getCurrentVersionNumber());
+    // the pending samples have been published
+    for(auto* handler : _pendingHandlers) handler->pending = false;
+    _pendingHandlers.clear();
+    _lastResync = std::chrono::steady_clock::now();
+  }
+
+  void ServerHistory::attachSharedMemory() {
+    size_t size = sizeof(SharedHistorySegmentHeader);
+    uint32_t nHistories = 0;
+    boost::fusion::for_each(_accessorListMap.table, AddSharedMemorySize(_nameListMap, size, nHistories));
+    _sharedSegment = std::make_unique<SharedHistorySegment>(_config.sharedMemoryName, size);
+    auto& header = _sharedSegment->header();
+    header.formatVersion = sharedHistoryFormatVersion;
+    header.nHistories = nHistories;
+    header.timeStampResolution = static_cast<uint32_t>(_config.timeStampResolution);
+    header.segmentSize = size;
+    auto* position = _sharedSegment->data() + sizeof(SharedHistorySegmentHeader);
+    boost::fusion::for_each(_accessorListMap.table, AttachSharedMemory(_nameListMap, position));
+    // readers check the magic, so it is written when the layout is complete
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header.magic, "CTKHSHM", sizeof(header.magic));
+  }
+
+  void ServerHistory::loadSnapshot() {
+    HistorySnapshotFile snapshot(_config.snapshotFile);
+    // time stamps in a different resolution are not converted
+    bool withTimeStamps = snapshot.timeStampResolution() == static_cast<uint32_t>(_config.timeStampResolution);
+    boost::fusion::for_each(_accessorListMap.table, LoadSnapshot(_nameListMap, snapshot, withTimeStamps));
+  }
+
+  void ServerHistory::syncScalarHistories() {
+    boost::fusion::for_each(_scalarHistoryMap.table, SyncScalarHistories());
+  }
+
+  void ServerHistory::fillExport() {
+    syncScalarHistories();
+    auto nHistories = _exportHistories;
+    for(auto& shard : _shards) nHistories += shard._exportHistories;
+    HistoryExportHeader header{{'C', 'T', 'K', 'H', 'E', 'X', 'P', '\0'}, historyExportFormatVersion, nHistories,
+        static_cast<uint32_t>(_config.timeStampResolution), 0, _exportSequence};
+    auto* position = _export.data();
+    std::memcpy(position, &header, sizeof(header));
+    position += sizeof(header);
+    boost::fusion::for_each(_accessorListMap.table, ExportEntries(_nameListMap, position));
+  }
+
+  void ServerHistory::completeExport() {
+    HistoryExportHeader header;
+    for(auto& shardExport : _shardExports) {
+      std::memcpy(&header, shardExport.data(), sizeof(header));
+      if(header.sequenceNumber != _exportSequence) return; // not yet received from this shard
+    }
+    auto* position = _export.data() + _exportSize;
+    for(auto& shardExport : _shardExports) {
+      auto size = shardExport.getNElements() - sizeof(HistoryExportHeader);
+      std::memcpy(position, shardExport.data() + sizeof(HistoryExportHeader), size);
+      position += size;
+    }
+    _export.write();
+  }
+
+  void ServerHistory::publishPending(const VersionNumber& version) {
+    for(auto* handler : _pendingHandlers) {
+      handler->publish(version);
+      handler->pending = false;
     }
+    _pendingHandlers.clear();
+    _lastPublication = std::chrono::steady_clock::now();
   }
 
 }} // namespace ChimeraTK::history
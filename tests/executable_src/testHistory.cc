@@ -11,7 +11,23 @@
 #include <boost/test/included/unit_test.hpp>
 #include <boost/thread.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <utility>
 
 using namespace boost::unit_test_framework;
 
@@ -90,10 +106,129 @@ struct testAppArray : public ChimeraTK::Application {
 };
 
 /**
- * Define a test app to test the device module in combination with the History Module.
+ * Define a test app with the given dummy modules and a History Module with the given configuration, used to test the
+ * individual features. The dummy modules are created before the History Module, so their variables are found.
+ */
+template<typename... Modules>
+struct testAppConfig : public ChimeraTK::Application {
+  testAppConfig(const ChimeraTK::history::ServerHistoryConfig& config,
+      const std::array<std::string, sizeof...(Modules)>& moduleNames)
+  : Application("test") {
+    size_t i = 0;
+    (dummies.push_back(std::make_unique<Modules>(this, moduleNames[i++], "Dummy module")), ...);
+    hist = ChimeraTK::history::ServerHistory{this, "history", "History of selected process variables.", config};
+  }
+  ~testAppConfig() override { shutdown(); }
+
+  std::vector<std::unique_ptr<ChimeraTK::ApplicationModule>> dummies;
+  ChimeraTK::history::ServerHistory hist;
+};
+
+/** Configuration of the History Module with the given history length, see testAppConfig */
+static ChimeraTK::history::ServerHistoryConfig historyConfig(size_t historyLength, bool enableTimeStamps = false) {
+  ChimeraTK::history::ServerHistoryConfig config;
+  config.historyLength = historyLength;
+  config.enableTimeStamps = enableTimeStamps;
+  return config;
+}
+
+/** Configuration publishing the status after each update */
+static ChimeraTK::history::ServerHistoryConfig statusConfig(size_t historyLength, bool enableTimeStamps = false) {
+  auto config = historyConfig(historyLength, enableTimeStamps);
+  config.enableStatus = true;
+  config.statusInterval = std::chrono::milliseconds(0);
+  return config;
+}
+
+/** Configuration of the export, used with the modules Dummy, DummyArray and DummyString */
+static ChimeraTK::history::ServerHistoryConfig exportConfig() {
+  auto config = historyConfig(4, true);
+  config.exportTrigger = "/Trigger/export";
+  return config;
+}
+
+/** Configuration restoring the snapshot written by saveSnapshot(), used with the modules Dummy and DummyArray */
+static ChimeraTK::history::ServerHistoryConfig snapshotConfig(size_t historyLength = 3) {
+  auto config = historyConfig(historyLength, true);
+  config.snapshotFile = "historySnapshot.bin";
+  return config;
+}
+
+struct DummyDeadband : public ChimeraTK::ApplicationModule {
+  using ApplicationModule::ApplicationModule;
+  ChimeraTK::ScalarPushInput<double> in{this, "in", "", "Dummy input"};
+  ChimeraTK::ScalarOutput<double> out{this, "out", "", "Dummy output", {"history", "deadband"}};
+
+  void mainLoop() override {
+    while(true) {
+      out = static_cast<double>(in);
+      out.write();
+      in.read();
+    }
+  }
+};
+
+struct DummyProfiles : public ChimeraTK::ApplicationModule {
+  using ApplicationModule::ApplicationModule;
+  ChimeraTK::ScalarPushInput<int> in{this, "in", "", "Dummy input"};
+  ChimeraTK::ScalarOutput<int> outShort{this, "outShort", "", "Dummy output", {"history", "history:5"}};
+  ChimeraTK::ScalarOutput<int> outFast{this, "outFast", "", "Dummy output", {"history", "fast"}};
+
+  void mainLoop() override {
+    while(true) {
+      outShort = static_cast<int>(in);
+      outShort.write();
+      outFast = static_cast<int>(in);
+      outFast.write();
+      in.read();
+    }
+  }
+};
+
+/**
+ * Module with a configurable number of array outputs, used to test the startup with many variables.
+ */
+struct DummyMany : public ChimeraTK::ApplicationModule {
+  DummyMany() = default;
+  DummyMany(ChimeraTK::ModuleGroup* owner, const std::string& name, size_t nVariables)
+  : ApplicationModule(owner, name, "Dummy module") {
+    for(size_t i = 0; i < nVariables; i++) {
+      outputs.emplace_back(this, "out" + std::to_string(i), "", 4, "Dummy output",
+          std::unordered_set<std::string>{"history"});
+    }
+  }
+  std::vector<ChimeraTK::ArrayOutput<int>> outputs;
+
+  void mainLoop() override {}
+};
+
+struct testAppMany : public ChimeraTK::Application {
+  explicit testAppMany(size_t nVariables, const std::string& exportTrigger = "") : Application("test") {
+    dummy = DummyMany{this, "Dummy", nVariables};
+    auto config = historyConfig(10, true);
+    config.exportTrigger = exportTrigger;
+    hist = ChimeraTK::history::ServerHistory{this, "history", "History of selected process variables.", config};
+  }
+  ~testAppMany() override { shutdown(); }
+
+  DummyMany dummy;
+  ChimeraTK::history::ServerHistory hist;
+};
+
+/**
+ * Define a test app to test the device module in combination with the History Module. If a filter is given, the
+ * device variables are selected with it instead of adding all of them.
  */
 struct testAppDev : public ChimeraTK::Application {
-  testAppDev() : Application("test") { hist.addSource(dev, ""); }
+  explicit testAppDev(const std::optional<ChimeraTK::history::SourceFilter>& filter = std::nullopt)
+  : Application("test") {
+    if(filter) {
+      hist.addSource(dev, *filter);
+    }
+    else {
+      hist.addSource(dev, "");
+    }
+  }
   ~testAppDev() override { shutdown(); }
 
   // Set dmap file before creating DeviceModules
@@ -223,3 +358,1094 @@ BOOST_AUTO_TEST_CASE(testDeviceHistory) {
   v = tf.readArray<float>("History/Device/signed32");
   BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
 }
+
+BOOST_AUTO_TEST_CASE(testRawRingHistory) {
+  std::cout << "testRawRingHistory" << std::endl;
+  auto config = historyConfig(20, true);
+  config.publishRawRing = true;
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto i = tf.getScalar<int>("Dummy/in");
+  tf.runApplication();
+  i = 42;
+  i.write();
+  tf.stepApplication();
+  auto head = tf.readScalar<uint32_t>("History/Dummy/out_head");
+  BOOST_CHECK(head > 0);
+  auto v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL(v.at(head - 1), 42);
+  BOOST_CHECK(tf.readArray<uint64_t>("History/Dummy/out_timeStamps").at(head - 1) > 0);
+
+  // the next entry is written to the position of the oldest entry
+  i = 43;
+  i.write();
+  tf.stepApplication();
+  BOOST_CHECK_EQUAL(tf.readScalar<uint32_t>("History/Dummy/out_head"), (head + 1) % 20);
+  v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL(v.at(head - 1), 42);
+  BOOST_CHECK_EQUAL(v.at(head), 43);
+}
+
+BOOST_AUTO_TEST_CASE(testMatrixHistory) {
+  std::cout << "testMatrixHistory" << std::endl;
+  auto config = historyConfig(20, true);
+  config.arrayAsMatrix = true;
+  config.timeStampResolution = ChimeraTK::history::TimeStampResolution::milliseconds;
+  testAppConfig<DummyArray<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto arr = tf.getArray<int>("Dummy/in");
+  tf.runApplication();
+  arr = std::vector<int>{42, 43, 44};
+  arr.write();
+  tf.stepApplication();
+  std::vector<int> v_ref(60);
+  v_ref[57] = 42;
+  v_ref[58] = 43;
+  v_ref[59] = 44;
+  auto v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  BOOST_CHECK_EQUAL(timeStamps.size(), 20);
+  // the time stamp is taken from the VersionNumber of the data written above
+  auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+  auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count());
+  BOOST_CHECK(timeStamps.back() <= now);
+  BOOST_CHECK(timeStamps.back() + 60000 > now);
+
+  arr = std::vector<int>{1, 2, 3};
+  arr.write();
+  tf.stepApplication();
+  std::copy(v_ref.begin() + 57, v_ref.end(), v_ref.begin() + 54);
+  v_ref[57] = 1;
+  v_ref[58] = 2;
+  v_ref[59] = 3;
+  v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
+}
+
+BOOST_AUTO_TEST_CASE(testSharedTimeStamps) {
+  std::cout << "testSharedTimeStamps" << std::endl;
+  auto config = historyConfig(20, true);
+  config.sharedTimeStamps = true;
+  testAppConfig<DummyArray<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto arr = tf.getArray<int>("Dummy/in");
+  tf.runApplication();
+  arr = std::vector<int>{42, 43, 44};
+  arr.write();
+  tf.stepApplication();
+  for(size_t i = 0; i < 3; i++) {
+    BOOST_CHECK_EQUAL(tf.readArray<int>("History/Dummy/out_" + std::to_string(i)).back(), static_cast<int>(42 + i));
+  }
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  BOOST_CHECK_EQUAL(timeStamps.size(), 20);
+  BOOST_CHECK(timeStamps.back() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(testDecimation) {
+  std::cout << "testDecimation" << std::endl;
+  auto config = historyConfig(20);
+  config.decimationStages = {{"x3", 3, 5}, {"x6", 2, 5}};
+  testAppConfig<Dummy<double>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto i = tf.getScalar<double>("Dummy/in");
+  tf.runApplication();
+  for(double val = 1; val <= 6; ++val) {
+    i = val;
+    i.write();
+    tf.stepApplication();
+  }
+  std::vector<double> mean = tf.readArray<double>("History/Dummy/out_x3_mean");
+  std::vector<double> min = tf.readArray<double>("History/Dummy/out_x3_min");
+  std::vector<double> max = tf.readArray<double>("History/Dummy/out_x3_max");
+  BOOST_CHECK_EQUAL(mean.size(), 5);
+  BOOST_CHECK_CLOSE(mean.at(3), 2., 1e-6);
+  BOOST_CHECK_CLOSE(mean.at(4), 5., 1e-6);
+  BOOST_CHECK_EQUAL(min.at(3), 1.);
+  BOOST_CHECK_EQUAL(min.at(4), 4.);
+  BOOST_CHECK_EQUAL(max.at(3), 3.);
+  BOOST_CHECK_EQUAL(max.at(4), 6.);
+
+  // the second stage combines two entries of the first stage
+  BOOST_CHECK_CLOSE(tf.readArray<double>("History/Dummy/out_x6_mean").back(), 3.5, 1e-6);
+  BOOST_CHECK_EQUAL(tf.readArray<double>("History/Dummy/out_x6_min").back(), 1.);
+  BOOST_CHECK_EQUAL(tf.readArray<double>("History/Dummy/out_x6_max").back(), 6.);
+}
+
+BOOST_AUTO_TEST_CASE(testPublishTrigger) {
+  std::cout << "testPublishTrigger" << std::endl;
+  auto config = historyConfig(20);
+  config.publishTrigger = "/Trigger/publish";
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto i = tf.getScalar<int>("Dummy/in");
+  auto trigger = tf.getScalar<uint64_t>("Trigger/publish");
+  tf.runApplication();
+  i = 42;
+  i.write();
+  tf.stepApplication();
+  i = 43;
+  i.write();
+  tf.stepApplication();
+
+  // samples are recorded but not yet published
+  std::vector<int> v_ref(20);
+  auto v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
+
+  trigger.write();
+  tf.stepApplication();
+  *(v_ref.end() - 2) = 42;
+  *(v_ref.end() - 1) = 43;
+  v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
+}
+
+BOOST_AUTO_TEST_CASE(testPersistence) {
+  std::cout << "testPersistence" << std::endl;
+  std::remove("History.Dummy.out.hist");
+  auto config = historyConfig(20, true);
+  config.persistencePath = ".";
+  std::vector<int> v_ref(20);
+  std::vector<uint64_t> timeStamps;
+  {
+    testAppConfig<Dummy<int>> app(config, {"Dummy"});
+    ChimeraTK::TestFacility tf(app);
+    auto i = tf.getScalar<int>("Dummy/in");
+    tf.runApplication();
+    i = 42;
+    i.write();
+    tf.stepApplication();
+    i = 43;
+    i.write();
+    tf.stepApplication();
+    *(v_ref.end() - 2) = 42;
+    *(v_ref.end() - 1) = 43;
+    auto v = tf.readArray<int>("History/Dummy/out");
+    BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
+    timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  }
+
+  // the history is restored after the restart
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  auto v = tf.readArray<int>("History/Dummy/out");
+  BOOST_CHECK_EQUAL_COLLECTIONS(v.begin(), v.end(), v_ref.begin(), v_ref.end());
+  auto t = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  BOOST_CHECK_EQUAL_COLLECTIONS(t.begin(), t.end(), timeStamps.begin(), timeStamps.end());
+  std::remove("History.Dummy.out.hist");
+}
+
+BOOST_AUTO_TEST_CASE(testPersistencePartial) {
+  std::cout << "testPersistencePartial" << std::endl;
+  std::remove("History.Dummy.out.hist");
+  auto config = historyConfig(20, true);
+  config.persistencePath = ".";
+  config.enableStatistics = true;
+  {
+    testAppConfig<Dummy<int>> app(config, {"Dummy"});
+    ChimeraTK::TestFacility tf(app);
+    tf.runApplication();
+    tf.writeScalar<int>("Dummy/in", 42);
+    tf.stepApplication();
+    tf.writeScalar<int>("Dummy/in", 43);
+    tf.stepApplication();
+  }
+
+  // the file records that only 2 rows are filled, so the empty rows are not part of the restored statistics
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  BOOST_CHECK_CLOSE(tf.readScalar<double>("History/Dummy/out_mean"), 42.5, 1e-9);
+  BOOST_CHECK_EQUAL(tf.readScalar<int>("History/Dummy/out_min"), 42);
+  BOOST_CHECK_EQUAL(tf.readScalar<int>("History/Dummy/out_max"), 43);
+  // the restored samples can be found by their time stamps
+  auto view = app.hist.getRange<int>("/Dummy/out", 0, std::numeric_limits<uint64_t>::max());
+  BOOST_CHECK_EQUAL(view.size(), 2);
+  BOOST_CHECK_EQUAL(view.value(1), 43);
+  std::remove("History.Dummy.out.hist");
+}
+
+BOOST_AUTO_TEST_CASE(testShards) {
+  std::cout << "testShards" << std::endl;
+  auto config = historyConfig(20);
+  config.numberOfShards = 2;
+  testAppConfig<Dummy<int>, Dummy<int>, Dummy<int>> app(config, {"Dummy1", "Dummy2", "Dummy3"});
+  BOOST_CHECK_EQUAL(app.hist.getNumberOfVariables(), 3);
+  BOOST_CHECK_EQUAL(app.hist.getNumberOfShards(), 1);
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(size_t k = 1; k <= 3; k++) {
+    tf.writeScalar<int>("Dummy" + std::to_string(k) + "/in", static_cast<int>(k * 10));
+  }
+  tf.stepApplication();
+  // the PV names do not depend on the shard the variable is handled by
+  for(size_t k = 1; k <= 3; k++) {
+    auto v = tf.readArray<int>("History/Dummy" + std::to_string(k) + "/out");
+    BOOST_CHECK_EQUAL(v.size(), 20);
+    BOOST_CHECK_EQUAL(v.back(), static_cast<int>(k * 10));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(testShardsInterface) {
+  std::cout << "testShardsInterface" << std::endl;
+  auto config = statusConfig(4, true);
+  config.exportTrigger = "/Trigger/export";
+  config.numberOfShards = 2;
+  testAppConfig<Dummy<int>, Dummy<int>, Dummy<int>> app(config, {"Dummy1", "Dummy2", "Dummy3"});
+  BOOST_CHECK_EQUAL(app.hist.getNumberOfShards(), 1);
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(size_t k = 1; k <= 3; k++) {
+    tf.writeScalar<int>("Dummy" + std::to_string(k) + "/in", static_cast<int>(k * 10));
+  }
+  tf.stepApplication();
+  // the main module records Dummy1 and Dummy3, and includes the last status received from the shard
+  tf.writeScalar<int>("Dummy1/in", 11);
+  tf.stepApplication();
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/updateCount"), 4);
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/ringMemory"), 3 * 4 * (sizeof(int) + sizeof(uint64_t)));
+
+  // the export trigger is forwarded to the shard, whose histories are included in the export of the main module
+  tf.writeScalar<uint64_t>("Trigger/export", 1);
+  tf.stepApplication();
+  auto blob = tf.readArray<uint8_t>("history/export");
+  ChimeraTK::history::HistoryExportHeader header;
+  std::memcpy(&header, blob.data(), sizeof(header));
+  BOOST_CHECK_EQUAL(header.nHistories, 3);
+  BOOST_CHECK_EQUAL(header.sequenceNumber, 1);
+  std::set<std::string> names;
+  auto* position = blob.data() + sizeof(header);
+  for(uint32_t n = 0; n < header.nHistories; n++) {
+    ChimeraTK::history::HistoryExportSection section;
+    std::memcpy(&section, position, sizeof(section));
+    names.emplace(reinterpret_cast<const char*>(position + sizeof(section)), section.nameLength);
+    position += section.sectionSize;
+  }
+  BOOST_CHECK(position == blob.data() + blob.size());
+  BOOST_CHECK(names == std::set<std::string>({"/Dummy1/out", "/Dummy2/out", "/Dummy3/out"}));
+}
+
+BOOST_AUTO_TEST_CASE(testStatus) {
+  std::cout << "testStatus" << std::endl;
+  auto config = statusConfig(20);
+  config.enableVariableStatus = true;
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/ringMemory"), 20 * sizeof(int));
+  for(int k = 1; k <= 3; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.stepApplication();
+  }
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/updateCount"), 3);
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("History/Dummy/out_updateCount"), 3);
+  BOOST_CHECK_EQUAL(tf.readScalar<uint32_t>("history/status/maxQueueDepth"), 1);
+  BOOST_CHECK_GT(tf.readScalar<float>("history/status/processingTimeP99"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(testScalarFastPath) {
+  std::cout << "testScalarFastPath" << std::endl;
+  // the compact recording of plain scalars gives the same histories as the generic path
+  std::vector<int> histories[2];
+  for(bool fastPath : {false, true}) {
+    auto config = statusConfig(4, true);
+    config.enableVariableStatus = true;
+    config.scalarFastPath = fastPath;
+    testAppConfig<Dummy<int>> app(config, {"Dummy"});
+    ChimeraTK::TestFacility tf(app);
+    tf.runApplication();
+    for(int k = 1; k <= 6; k++) {
+      tf.writeScalar<int>("Dummy/in", k);
+      tf.stepApplication();
+    }
+    BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("History/Dummy/out_updateCount"), 6);
+    auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+    BOOST_CHECK(std::is_sorted(timeStamps.begin(), timeStamps.end()));
+    histories[fastPath] = tf.readArray<int>("History/Dummy/out");
+  }
+  std::vector<int> historyRef{3, 4, 5, 6};
+  BOOST_CHECK_EQUAL_COLLECTIONS(histories[0].begin(), histories[0].end(), historyRef.begin(), historyRef.end());
+  BOOST_CHECK_EQUAL_COLLECTIONS(histories[1].begin(), histories[1].end(), historyRef.begin(), historyRef.end());
+}
+
+BOOST_AUTO_TEST_CASE(testManyVariables) {
+  std::cout << "testManyVariables" << std::endl;
+  // the scaling of the construction time is measured by the benchmark constructApplication
+  testAppMany app(4000);
+  BOOST_CHECK_EQUAL(app.hist.getNumberOfVariables(), 4000);
+  // all variables are registered, including the last one
+  BOOST_CHECK(app.hist.getRange<int>("/Dummy/out0", 1, 2).empty());
+  BOOST_CHECK(app.hist.getRange<int>("/Dummy/out3999", 1, 2).empty());
+  BOOST_CHECK_THROW(app.hist.getRange<int>("/Dummy/out4000", 1, 2), ChimeraTK::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE(testCompactStorage) {
+  std::cout << "testCompactStorage" << std::endl;
+  auto config = historyConfig(20, true);
+  config.timeStampResolution = ChimeraTK::history::TimeStampResolution::milliseconds;
+  config.storagePolicy.coding = ChimeraTK::history::SampleCoding::quantised;
+  config.storagePolicy.quantisationStep = 0.25;
+  config.storagePolicy.compactTimeStamps = true;
+  testAppConfig<Dummy<double>, Dummy<int16_t>> app(config, {"Dummy", "DummyShort"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  tf.writeScalar<double>("Dummy/in", 1.1);
+  tf.writeScalar<int16_t>("DummyShort/in", 12345);
+  tf.stepApplication();
+  // the double is stored as multiple of the quantisation step, the 16 bit integer is stored natively
+  BOOST_CHECK_CLOSE(tf.readArray<double>("History/Dummy/out").back(), 1.0, 1e-9);
+  BOOST_CHECK_EQUAL(tf.readArray<int16_t>("History/DummyShort/out").back(), 12345);
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  BOOST_CHECK_EQUAL(timeStamps.front(), 0);
+  auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+  auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count());
+  BOOST_CHECK(timeStamps.back() <= now);
+  BOOST_CHECK(timeStamps.back() + 60000 > now);
+}
+
+BOOST_AUTO_TEST_CASE(testStorageCodings) {
+  std::cout << "testStorageCodings" << std::endl;
+  ChimeraTK::history::QuantisedCoding<int32_t> quantised{10.};
+  BOOST_CHECK_EQUAL(quantised.decode(quantised.encode(1234)), 1230);
+  BOOST_CHECK_EQUAL(quantised.decode(quantised.encode(-10000000)), -327680);
+  ChimeraTK::history::QuantisedCoding<uint32_t> quantisedUnsigned{1.};
+  BOOST_CHECK_EQUAL(quantisedUnsigned.decode(quantisedUnsigned.encode(60000)), 60000);
+  ChimeraTK::history::Float32Coding<double> float32;
+  BOOST_CHECK_CLOSE(float32.decode(float32.encode(1. / 3.)), 1. / 3., 1e-5);
+
+  // time stamps beyond the 32 bit range of the offsets move the base
+  ChimeraTK::history::CompactTimeStampBuffer timeStamps(3);
+  uint64_t start = 1700000000000000000ULL;
+  timeStamps.set(0, start);
+  timeStamps.set(1, start + 1000);
+  BOOST_CHECK_EQUAL(timeStamps[0], start);
+  BOOST_CHECK_EQUAL(timeStamps[1], start + 1000);
+  BOOST_CHECK_EQUAL(timeStamps[2], 0);
+  timeStamps.set(2, start + 3000000000ULL);
+  BOOST_CHECK_EQUAL(timeStamps[0], start);
+  BOOST_CHECK_EQUAL(timeStamps[2], start + 3000000000ULL);
+  // the span to the oldest entry exceeds the range, so the oldest entries are saturated
+  timeStamps.set(0, start + 5000000000ULL);
+  BOOST_CHECK_EQUAL(timeStamps[0], start + 5000000000ULL);
+  BOOST_CHECK_EQUAL(timeStamps[1], start + 5000000000ULL - 4294967294ULL);
+  BOOST_CHECK_EQUAL(timeStamps[2], start + 3000000000ULL);
+
+  // row conversions, including the elements not handled by SIMD instructions
+  std::vector<double> doubles(11);
+  for(size_t i = 0; i < doubles.size(); i++) doubles[i] = static_cast<double>(i) / 3.;
+  std::vector<float> floats(doubles.size());
+  ChimeraTK::history::encodeRow(float32, doubles.data(), floats.data(), doubles.size());
+  std::vector<double> decoded(doubles.size());
+  ChimeraTK::history::decodeRow(float32, floats.data(), decoded.data(), floats.size());
+  for(size_t i = 0; i < doubles.size(); i++) {
+    BOOST_CHECK_EQUAL(floats[i], static_cast<float>(doubles[i]));
+    BOOST_CHECK_EQUAL(decoded[i], static_cast<double>(floats[i]));
+  }
+
+  ChimeraTK::history::StringSlotBuffer strings(2, 4);
+  strings[0] = std::string("abc");
+  strings[1] = std::string("abcdef");
+  BOOST_CHECK_EQUAL(std::as_const(strings)[0], "abc");
+  BOOST_CHECK_EQUAL(std::as_const(strings)[1], "abcd");
+  BOOST_CHECK_EQUAL(strings.memorySize(), 8 + 2 * sizeof(uint32_t));
+}
+
+BOOST_AUTO_TEST_CASE(testStringSlots) {
+  std::cout << "testStringSlots" << std::endl;
+  auto config = historyConfig(20);
+  config.storagePolicy.coding = ChimeraTK::history::SampleCoding::stringSlots;
+  config.storagePolicy.stringSlotSize = 8;
+  testAppConfig<Dummy<std::string>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  tf.writeScalar<std::string>("Dummy/in", "hello");
+  tf.stepApplication();
+  tf.writeScalar<std::string>("Dummy/in", "0123456789");
+  tf.stepApplication();
+  auto v = tf.readArray<std::string>("History/Dummy/out");
+  BOOST_CHECK_EQUAL(v.size(), 20);
+  BOOST_CHECK_EQUAL(v[17], "");
+  BOOST_CHECK_EQUAL(v[18], "hello");
+  // strings longer than the slot size are truncated
+  BOOST_CHECK_EQUAL(v[19], "01234567");
+}
+
+BOOST_AUTO_TEST_CASE(testDeadband) {
+  std::cout << "testDeadband" << std::endl;
+  auto config = statusConfig(20);
+  config.enableVariableStatus = true;
+  config.tagRecordingPolicies["deadband"] = {ChimeraTK::history::RecordingMode::absoluteDeadband, 0.5};
+  testAppConfig<DummyDeadband, Dummy<double>> app(config, {"Dummy", "DummyAlways"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(double value : {1.0, 1.2, 0.7, 2.0}) {
+    tf.writeScalar<double>("Dummy/in", value);
+    tf.writeScalar<double>("DummyAlways/in", value);
+    tf.stepApplication();
+  }
+  // changes within the deadband of the last recorded sample are skipped
+  auto v = tf.readArray<double>("History/Dummy/out");
+  BOOST_CHECK_EQUAL(v[17], 0.0);
+  BOOST_CHECK_EQUAL(v[18], 1.0);
+  BOOST_CHECK_EQUAL(v[19], 2.0);
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("History/Dummy/out_skippedCount"), 2);
+  // variables without the tag record every update
+  v = tf.readArray<double>("History/DummyAlways/out");
+  BOOST_CHECK_EQUAL(v[16], 1.0);
+  BOOST_CHECK_EQUAL(v[19], 2.0);
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/skippedCount"), 2);
+}
+
+BOOST_AUTO_TEST_CASE(testGetRange) {
+  std::cout << "testGetRange" << std::endl;
+  auto config = historyConfig(5, true);
+  config.timeStampResolution = ChimeraTK::history::TimeStampResolution::nanoseconds;
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(int k = 1; k <= 7; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.stepApplication();
+  }
+  // the ring holds 3..7 and wraps around
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  auto view = app.hist.getRange<int>("/Dummy/out", timeStamps[1], timeStamps[3]);
+  BOOST_CHECK_EQUAL(view.size(), 3);
+  BOOST_CHECK_EQUAL(view.getNumberOfElements(), 1);
+  for(size_t k = 0; k < view.size(); k++) {
+    BOOST_CHECK_EQUAL(view.value(k), static_cast<int>(k) + 4);
+    BOOST_CHECK_EQUAL(view.timeStamp(k), timeStamps[k + 1]);
+  }
+  std::vector<int> values;
+  for(size_t i = 0; i < 2; i++) {
+    auto segment = view.segment(i);
+    values.insert(values.end(), segment.first, segment.first + segment.second);
+  }
+  std::vector<int> valuesRef{4, 5, 6};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  BOOST_CHECK(view.valid());
+
+  // time stamps between the samples and outside of the history
+  BOOST_CHECK_EQUAL(app.hist.getRange<int>("/Dummy/out", timeStamps[4] + 1, timeStamps[4] + 100).size(), 0);
+  BOOST_CHECK_EQUAL(app.hist.getRange<int>("/Dummy/out", 0, timeStamps[0]).size(), 1);
+
+  // overwriting the oldest sample of the view invalidates it
+  auto oldest = app.hist.getRange<int>("/Dummy/out", timeStamps[0], timeStamps[4]);
+  BOOST_CHECK_EQUAL(oldest.size(), 5);
+  tf.writeScalar<int>("Dummy/in", 8);
+  tf.stepApplication();
+  BOOST_CHECK(!oldest.valid());
+  BOOST_CHECK(view.valid());
+
+  BOOST_CHECK_THROW(app.hist.getRange<int>("/Dummy/unknown", 0, 1), ChimeraTK::logic_error);
+  BOOST_CHECK_THROW(app.hist.getRange<double>("/Dummy/out", 0, 1), ChimeraTK::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE(testGetRangePartial) {
+  std::cout << "testGetRangePartial" << std::endl;
+  auto config = historyConfig(5, true);
+  config.timeStampResolution = ChimeraTK::history::TimeStampResolution::nanoseconds;
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  BOOST_CHECK(app.hist.getRange<int>("/Dummy/out", 0, std::numeric_limits<uint64_t>::max()).empty());
+  for(int k = 1; k <= 2; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.stepApplication();
+  }
+  // the 3 rows which were never written have the time stamp 0, but are not part of the range
+  auto view = app.hist.getRange<int>("/Dummy/out", 0, std::numeric_limits<uint64_t>::max());
+  BOOST_CHECK_EQUAL(view.size(), 2);
+  for(size_t k = 0; k < view.size(); k++) {
+    BOOST_CHECK_EQUAL(view.value(k), static_cast<int>(k) + 1);
+    BOOST_CHECK_GT(view.timeStamp(k), 0);
+  }
+  BOOST_CHECK(view.valid());
+  BOOST_CHECK_EQUAL(app.hist.getRange<int>("/Dummy/out", 0, 0).size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(testStatistics) {
+  std::cout << "testStatistics" << std::endl;
+  auto config = historyConfig(3);
+  config.enableStatistics = true;
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  auto check = [&](double mean, double rms, int min, int max) {
+    BOOST_CHECK_CLOSE(tf.readScalar<double>("History/Dummy/out_mean"), mean, 1e-9);
+    BOOST_CHECK_CLOSE(tf.readScalar<double>("History/Dummy/out_rms"), rms, 1e-9);
+    BOOST_CHECK_EQUAL(tf.readScalar<int>("History/Dummy/out_min"), min);
+    BOOST_CHECK_EQUAL(tf.readScalar<int>("History/Dummy/out_max"), max);
+  };
+  // the statistics only cover the samples recorded so far
+  tf.writeScalar<int>("Dummy/in", 1);
+  tf.stepApplication();
+  check(1., 1., 1, 1);
+  for(int value : {5, 3}) {
+    tf.writeScalar<int>("Dummy/in", value);
+    tf.stepApplication();
+  }
+  check(3., std::sqrt(35. / 3.), 1, 5);
+  // the oldest samples leave the window
+  tf.writeScalar<int>("Dummy/in", 2);
+  tf.stepApplication();
+  check(10. / 3., std::sqrt(38. / 3.), 2, 5);
+  tf.writeScalar<int>("Dummy/in", 1);
+  tf.stepApplication();
+  check(2., std::sqrt(14. / 3.), 1, 3);
+}
+
+BOOST_AUTO_TEST_CASE(testWindowStatistics) {
+  std::cout << "testWindowStatistics" << std::endl;
+  // compare with a direct computation over a long random sequence, which includes several recomputations
+  const size_t historyLength = 7;
+  ChimeraTK::history::WindowStatistics<double> statistics(1, historyLength);
+  std::vector<double> values;
+  uint64_t state = 12345;
+  for(size_t k = 0; k < 100; k++) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    values.push_back(static_cast<double>(state >> 40) / 1000. - 5000.);
+    double removed = values.size() > historyLength ? values[values.size() - 1 - historyLength] : 0.;
+    statistics.update(0, values.back(), removed);
+    if(statistics.nextSample()) {
+      auto first = values.size() - statistics.count();
+      statistics.recompute(statistics.count(), [&](size_t j, size_t) { return values[first + j]; });
+    }
+    auto begin = values.end() - static_cast<std::ptrdiff_t>(statistics.count());
+    double sum = 0, sumSquares = 0;
+    for(auto it = begin; it != values.end(); ++it) {
+      sum += *it;
+      sumSquares += *it * *it;
+    }
+    auto n = static_cast<double>(statistics.count());
+    BOOST_CHECK_CLOSE(statistics.mean(0), sum / n, 1e-6);
+    BOOST_CHECK_CLOSE(statistics.rms(0), std::sqrt(sumSquares / n), 1e-6);
+    BOOST_CHECK_EQUAL(statistics.min(0), *std::min_element(begin, values.end()));
+    BOOST_CHECK_EQUAL(statistics.max(0), *std::max_element(begin, values.end()));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(testLazyAllocation) {
+  std::cout << "testLazyAllocation" << std::endl;
+  auto config = statusConfig(100, true);
+  config.storagePolicy.lazyAllocation = true;
+  testAppConfig<Dummy<int>, Dummy<int>> app(config, {"Dummy1", "Dummy2"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/ringMemory"), 0);
+  // the outputs of both variables are allocated regardless
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/outputMemory"), 2 * 100 * (sizeof(int) + sizeof(uint64_t)));
+  BOOST_CHECK(app.hist.getRange<int>("/Dummy1/out", 0, std::numeric_limits<uint64_t>::max()).empty());
+  // only the ring of the updated variable is allocated
+  tf.writeScalar<int>("Dummy1/in", 42);
+  tf.stepApplication();
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/ringMemory"), 100 * (sizeof(int) + sizeof(uint64_t)));
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/outputMemory"), 2 * 100 * (sizeof(int) + sizeof(uint64_t)));
+  auto v = tf.readArray<int>("History/Dummy1/out");
+  BOOST_CHECK_EQUAL(v.size(), 100);
+  BOOST_CHECK_EQUAL(v.back(), 42);
+  BOOST_CHECK_EQUAL(v.front(), 0);
+  BOOST_CHECK_EQUAL(app.hist.getRange<int>("/Dummy1/out", 1, std::numeric_limits<uint64_t>::max()).size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(testProfiles) {
+  std::cout << "testProfiles" << std::endl;
+  auto config = historyConfig(20);
+  config.queueLength = 2;
+  config.overrunPolicy = ChimeraTK::history::OverrunPolicy::dropOldest;
+  config.tagProfiles["fast"] = {50, true};
+  testAppConfig<DummyProfiles, Dummy<int>> app(config, {"Dummy", "DummyDefault"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  tf.writeScalar<int>("Dummy/in", 42);
+  tf.writeScalar<int>("DummyDefault/in", 42);
+  tf.stepApplication();
+  // the length tag sets the history length
+  auto v = tf.readArray<int>("History/Dummy/outShort");
+  BOOST_CHECK_EQUAL(v.size(), 5);
+  BOOST_CHECK_EQUAL(v.back(), 42);
+  // the profile sets the history length and enables the time stamps
+  v = tf.readArray<int>("History/Dummy/outFast");
+  BOOST_CHECK_EQUAL(v.size(), 50);
+  BOOST_CHECK_EQUAL(v.back(), 42);
+  BOOST_CHECK_EQUAL(tf.readArray<uint64_t>("History/Dummy/outFast_timeStamps").size(), 50);
+  // the queue settings not given in the profile are taken from the module configuration
+  BOOST_CHECK_EQUAL(tf.readArray<uint32_t>("History/Dummy/outFast_dropped").size(), 50);
+  // other variables use the module configuration
+  v = tf.readArray<int>("History/DummyDefault/out");
+  BOOST_CHECK_EQUAL(v.size(), 20);
+  BOOST_CHECK_EQUAL(v.back(), 42);
+}
+
+BOOST_AUTO_TEST_CASE(testExport) {
+  std::cout << "testExport" << std::endl;
+  testAppConfig<Dummy<int>, DummyArray<double>, Dummy<std::string>> app(
+      exportConfig(), {"Dummy", "DummyArray", "DummyString"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(int k = 1; k <= 5; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.writeArray<double>("DummyArray/in", {k + 0.5, k + 0.25, -static_cast<double>(k)});
+    tf.stepApplication();
+  }
+  tf.writeScalar<uint64_t>("Trigger/export", 1);
+  tf.stepApplication();
+  auto blob = tf.readArray<uint8_t>("history/export");
+
+  ChimeraTK::history::HistoryExportHeader header;
+  std::memcpy(&header, blob.data(), sizeof(header));
+  BOOST_CHECK_EQUAL(std::string(header.magic), "CTKHEXP");
+  BOOST_CHECK_EQUAL(header.formatVersion, ChimeraTK::history::historyExportFormatVersion);
+  // strings are not exported
+  BOOST_CHECK_EQUAL(header.nHistories, 2);
+  BOOST_CHECK_EQUAL(header.sequenceNumber, 1);
+
+  // walk through the sections, which are ordered by type
+  auto* position = blob.data() + sizeof(header);
+  for(uint32_t n = 0; n < header.nHistories; n++) {
+    ChimeraTK::history::HistoryExportSection section;
+    std::memcpy(&section, position, sizeof(section));
+    std::string name(reinterpret_cast<const char*>(position + sizeof(section)), section.nameLength);
+    BOOST_CHECK_EQUAL(section.nSamples, 4);
+    BOOST_CHECK_EQUAL(section.timeStamps, 1);
+    auto* timeStamps = position + sizeof(section) + ChimeraTK::history::exportPadded(section.nameLength);
+    auto* columns = timeStamps + section.nSamples * sizeof(uint64_t);
+    // time stamps and samples start with the oldest sample
+    uint64_t first, last;
+    std::memcpy(&first, timeStamps, sizeof(first));
+    std::memcpy(&last, timeStamps + 3 * sizeof(uint64_t), sizeof(last));
+    BOOST_CHECK_LE(first, last);
+    if(name == "/Dummy/out") {
+      BOOST_CHECK_EQUAL(section.typeCode, ChimeraTK::history::persistentTypeCode<int>());
+      BOOST_CHECK_EQUAL(section.nElements, 1);
+      std::vector<int> values(4), valuesRef{2, 3, 4, 5};
+      std::memcpy(values.data(), columns, 4 * sizeof(int));
+      BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+    }
+    else {
+      BOOST_CHECK_EQUAL(name, "/DummyArray/out");
+      BOOST_CHECK_EQUAL(section.typeCode, ChimeraTK::history::persistentTypeCode<double>());
+      BOOST_CHECK_EQUAL(section.nElements, 3);
+      // column 2 holds the last element of all samples
+      std::vector<double> values(4), valuesRef{-2, -3, -4, -5};
+      std::memcpy(values.data(), columns + 2 * 4 * sizeof(double), 4 * sizeof(double));
+      BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+    }
+    position += section.sectionSize;
+  }
+  BOOST_CHECK(position == blob.data() + blob.size());
+}
+
+BOOST_AUTO_TEST_CASE(testOverrun) {
+  std::cout << "testOverrun" << std::endl;
+  using ChimeraTK::history::OverrunPolicy;
+  auto overrunConfig = [](OverrunPolicy policy) {
+    auto config = statusConfig(5);
+    config.queueLength = 2;
+    config.overrunPolicy = policy;
+    config.reportDataLoss = true;
+    return config;
+  };
+  // three updates arrive in one burst, the queue holds two of them
+  auto run = [&](OverrunPolicy policy) {
+    testAppConfig<Dummy<int>> app(overrunConfig(policy), {"Dummy"});
+    ChimeraTK::TestFacility tf(app);
+    tf.runApplication();
+    for(int k = 1; k <= 3; k++) tf.writeScalar<int>("Dummy/in", k);
+    tf.stepApplication();
+    return std::make_tuple(tf.readArray<int>("History/Dummy/out"), tf.readArray<uint32_t>("History/Dummy/out_dropped"),
+        tf.readScalar<uint64_t>("history/status/overrunCount"));
+  };
+
+  auto [values, dropped, overruns] = run(OverrunPolicy::dropOldest);
+  std::vector<int> valuesRef{0, 0, 0, 2, 3};
+  std::vector<uint32_t> droppedRef{0, 0, 0, 1, 0};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  BOOST_CHECK_EQUAL_COLLECTIONS(dropped.begin(), dropped.end(), droppedRef.begin(), droppedRef.end());
+  BOOST_CHECK_EQUAL(overruns, 1);
+
+  std::tie(values, dropped, overruns) = run(OverrunPolicy::coalesce);
+  valuesRef = {0, 0, 0, 1, 3};
+  droppedRef = {0, 0, 0, 0, 1};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  BOOST_CHECK_EQUAL_COLLECTIONS(dropped.begin(), dropped.end(), droppedRef.begin(), droppedRef.end());
+  BOOST_CHECK_EQUAL(overruns, 1);
+
+  // blocking records all samples and does not create the gap markers
+  testAppConfig<Dummy<int>> app(overrunConfig(OverrunPolicy::block), {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(int k = 1; k <= 3; k++) tf.writeScalar<int>("Dummy/in", k);
+  tf.stepApplication();
+  values = tf.readArray<int>("History/Dummy/out");
+  valuesRef = {0, 0, 1, 2, 3};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/overrunCount"), 0);
+  // the burst fits into the queue of the ApplicationCore input, so no update is lost before reaching the module
+  BOOST_CHECK_EQUAL(tf.readScalar<uint64_t>("history/status/dataLossCount"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(testAppend) {
+  std::cout << "testAppend" << std::endl;
+  auto config = historyConfig(20, true);
+  config.appendSize = 2;
+  config.resyncTrigger = "/Trigger/resync";
+  testAppConfig<DummyArray<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto history = tf.getArray<int>("History/Dummy/out_0");
+  auto append = tf.getArray<int>("History/Dummy/out_append");
+  auto sequence = tf.getScalar<uint64_t>("History/Dummy/out_sequence");
+  tf.runApplication();
+  history.readLatest();
+  append.readLatest();
+  sequence.readLatest();
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(sequence), 0);
+
+  // only the new sample is published
+  tf.writeArray<int>("Dummy/in", {1, 2, 3});
+  tf.stepApplication();
+  BOOST_CHECK(!history.readNonBlocking());
+  BOOST_CHECK(append.readNonBlocking());
+  BOOST_CHECK(sequence.readNonBlocking());
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(sequence), 1);
+  BOOST_CHECK_EQUAL(append.getNElements(), 6);
+  std::vector<int> newSample(append.begin(), append.begin() + 3), newSampleRef{1, 2, 3};
+  BOOST_CHECK_EQUAL_COLLECTIONS(newSample.begin(), newSample.end(), newSampleRef.begin(), newSampleRef.end());
+  BOOST_CHECK_EQUAL(tf.readArray<uint64_t>("History/Dummy/out_append_timeStamps").size(), 2);
+
+  // the complete history is published on request
+  tf.writeArray<int>("Dummy/in", {4, 5, 6});
+  tf.stepApplication();
+  tf.writeScalar<uint64_t>("Trigger/resync", 1);
+  tf.stepApplication();
+  BOOST_CHECK(history.readNonBlocking());
+  BOOST_CHECK_EQUAL(history[18], 1);
+  BOOST_CHECK_EQUAL(history[19], 4);
+  sequence.readLatest();
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(sequence), 2);
+}
+
+BOOST_AUTO_TEST_CASE(testBatch) {
+  std::cout << "testBatch" << std::endl;
+  auto config = historyConfig(5, true);
+  config.timeStampResolution = ChimeraTK::history::TimeStampResolution::nanoseconds;
+  testAppConfig<DummyProfiles> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  // both outputs are written with the same VersionNumber, so they are recorded as one batch
+  for(int k = 1; k <= 2; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.stepApplication();
+  }
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/outShort_timeStamps");
+  auto timeStampsFast = tf.readArray<uint64_t>("History/Dummy/outFast_timeStamps");
+  BOOST_CHECK_EQUAL_COLLECTIONS(timeStamps.begin(), timeStamps.end(), timeStampsFast.begin(), timeStampsFast.end());
+  BOOST_CHECK_LT(timeStamps[3], timeStamps[4]);
+  BOOST_CHECK_EQUAL(tf.readArray<int>("History/Dummy/outShort").back(), 2);
+  BOOST_CHECK_EQUAL(tf.readArray<int>("History/Dummy/outFast").back(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(testBatchVersion) {
+  std::cout << "testBatchVersion" << std::endl;
+  testApp<int> app;
+  ChimeraTK::TestFacility tf(app);
+  auto i = tf.getScalar<int>("Dummy/in");
+  auto history = tf.getArray<int>("History/Dummy/out");
+  tf.runApplication();
+  history.readLatest();
+  // each batch is published with its own VersionNumber, also if the next batch is read in the same burst
+  ChimeraTK::VersionNumber v1, v2, v3;
+  i = 1;
+  i.write(v1);
+  tf.stepApplication();
+  BOOST_CHECK(history.readNonBlocking());
+  BOOST_CHECK(history.getVersionNumber() == v1);
+  i = 2;
+  i.write(v2);
+  i = 3;
+  i.write(v3);
+  tf.stepApplication();
+  BOOST_CHECK(history.readNonBlocking());
+  BOOST_CHECK(history.getVersionNumber() == v2);
+  BOOST_CHECK_EQUAL(history[19], 2);
+  BOOST_CHECK(history.readNonBlocking());
+  BOOST_CHECK(history.getVersionNumber() == v3);
+  BOOST_CHECK_EQUAL(history[19], 3);
+}
+
+BOOST_AUTO_TEST_CASE(testSharedMemory) {
+  std::cout << "testSharedMemory" << std::endl;
+  auto config = historyConfig(4, true);
+  config.sharedMemoryName = "/ctkHistoryTest";
+  testAppConfig<Dummy<int>, DummyArray<double>, Dummy<std::string>> app(config, {"Dummy", "DummyArray", "DummyString"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(int k = 1; k <= 5; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.writeArray<double>("DummyArray/in", {k + 0.5, k + 0.25, -static_cast<double>(k)});
+    tf.stepApplication();
+  }
+
+  // map the segment like an external reader would do
+  auto fd = shm_open("/ctkHistoryTest", O_RDONLY, 0);
+  BOOST_REQUIRE(fd >= 0);
+  ChimeraTK::history::SharedHistorySegmentHeader header;
+  BOOST_REQUIRE(read(fd, &header, sizeof(header)) == sizeof(header));
+  BOOST_CHECK_EQUAL(std::string(header.magic), "CTKHSHM");
+  BOOST_CHECK_EQUAL(header.formatVersion, ChimeraTK::history::sharedHistoryFormatVersion);
+  // strings are not kept in the segment
+  BOOST_CHECK_EQUAL(header.nHistories, 2);
+  auto* segment = static_cast<const char*>(mmap(nullptr, header.segmentSize, PROT_READ, MAP_SHARED, fd, 0));
+  close(fd);
+  BOOST_REQUIRE(segment != MAP_FAILED);
+
+  auto* position = segment + sizeof(header);
+  for(uint32_t n = 0; n < header.nHistories; n++) {
+    auto* entry = reinterpret_cast<const ChimeraTK::history::SharedHistoryEntryHeader*>(position);
+    std::string name(position + sizeof(*entry), entry->nameLength);
+    auto finished = entry->finished.load(std::memory_order_acquire);
+    BOOST_CHECK_EQUAL(entry->started.load(std::memory_order_relaxed), finished);
+    BOOST_CHECK_EQUAL(entry->historyLength, 4);
+    BOOST_CHECK(entry->timeStampOffset != 0);
+    // the most recent sample is in row (finished - 1) % historyLength
+    auto row = (finished - 1) % entry->historyLength;
+    if(name == "/Dummy/out") {
+      BOOST_CHECK_EQUAL(entry->typeCode, ChimeraTK::history::persistentTypeCode<int>());
+      BOOST_CHECK_EQUAL(entry->nElements, 1);
+      BOOST_CHECK_EQUAL(reinterpret_cast<const int*>(position + entry->dataOffset)[row], 5);
+    }
+    else {
+      BOOST_CHECK_EQUAL(name, "/DummyArray/out");
+      BOOST_CHECK_EQUAL(entry->typeCode, ChimeraTK::history::persistentTypeCode<double>());
+      BOOST_CHECK_EQUAL(entry->nElements, 3);
+      BOOST_CHECK_EQUAL(reinterpret_cast<const double*>(position + entry->dataOffset)[row * 3 + 2], -5.);
+    }
+    position += entry->entrySize;
+  }
+  BOOST_CHECK(position == segment + header.segmentSize);
+  munmap(const_cast<char*>(segment), header.segmentSize);
+}
+
+BOOST_AUTO_TEST_CASE(testSharedMemoryRestart) {
+  std::cout << "testSharedMemoryRestart" << std::endl;
+  // a restarted server replaces the segment while a reader still maps the previous one
+  auto previous = std::make_unique<ChimeraTK::history::SharedHistorySegment>("/ctkHistoryRestartTest", 4096);
+  previous->data()[100] = 42;
+  auto fd = shm_open("/ctkHistoryRestartTest", O_RDONLY, 0);
+  BOOST_REQUIRE(fd >= 0);
+  auto* reader = static_cast<const char*>(mmap(nullptr, 4096, PROT_READ, MAP_SHARED, fd, 0));
+  close(fd);
+  BOOST_REQUIRE(reader != MAP_FAILED);
+
+  ChimeraTK::history::SharedHistorySegment current("/ctkHistoryRestartTest", 4096);
+  // the old mapping stays readable and the new segment is zero-filled
+  BOOST_CHECK_EQUAL(reader[100], 42);
+  BOOST_CHECK_EQUAL(current.data()[100], 0);
+
+  // removing the previous segment must not remove the current one
+  previous.reset();
+  fd = shm_open("/ctkHistoryRestartTest", O_RDONLY, 0);
+  BOOST_CHECK(fd >= 0);
+  if(fd >= 0) close(fd);
+  munmap(const_cast<char*>(reader), 4096);
+}
+
+/** Save the export of histories with 4 samples (the values 2 to 5) as snapshot, see snapshotConfig() */
+static void saveSnapshot() {
+  testAppConfig<Dummy<int>, DummyArray<double>, Dummy<std::string>> app(
+      exportConfig(), {"Dummy", "DummyArray", "DummyString"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  for(int k = 1; k <= 5; k++) {
+    tf.writeScalar<int>("Dummy/in", k);
+    tf.writeArray<double>("DummyArray/in", {k + 0.5, k + 0.25, -static_cast<double>(k)});
+    tf.stepApplication();
+  }
+  tf.writeScalar<uint64_t>("Trigger/export", 1);
+  tf.stepApplication();
+  auto blob = tf.readArray<uint8_t>("history/export");
+  std::ofstream file("historySnapshot.bin", std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(blob.data()), static_cast<std::streamsize>(blob.size()));
+}
+
+BOOST_AUTO_TEST_CASE(testSnapshot) {
+  std::cout << "testSnapshot" << std::endl;
+  saveSnapshot();
+  testAppConfig<Dummy<int>, DummyArray<double>> app(snapshotConfig(), {"Dummy", "DummyArray"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  // the histories are shorter than in the snapshot, so only the newest samples are restored
+  auto values = tf.readArray<int>("History/Dummy/out");
+  std::vector<int> valuesRef{3, 4, 5};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  auto arrayValues = tf.readArray<double>("History/DummyArray/out_2");
+  std::vector<double> arrayValuesRef{-3, -4, -5};
+  BOOST_CHECK_EQUAL_COLLECTIONS(arrayValues.begin(), arrayValues.end(), arrayValuesRef.begin(), arrayValuesRef.end());
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_timeStamps");
+  BOOST_CHECK(timeStamps[0] != 0);
+  BOOST_CHECK_LE(timeStamps[0], timeStamps[2]);
+
+  // new samples continue the restored history
+  tf.writeScalar<int>("Dummy/in", 6);
+  tf.stepApplication();
+  values = tf.readArray<int>("History/Dummy/out");
+  valuesRef = {4, 5, 6};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  std::remove("historySnapshot.bin");
+}
+
+BOOST_AUTO_TEST_CASE(testCapture) {
+  std::cout << "testCapture" << std::endl;
+  auto config = historyConfig(10, true);
+  config.captureTrigger = "/Trigger/capture";
+  config.capturePreSamples = 2;
+  config.capturePostSamples = 2;
+  testAppConfig<Dummy<int>> app(config, {"Dummy"});
+  ChimeraTK::TestFacility tf(app);
+  auto capture = tf.getArray<int>("History/Dummy/out_capture");
+  tf.runApplication();
+  capture.readLatest();
+  auto write = [&](int from, int to) {
+    for(int k = from; k <= to; k++) {
+      tf.writeScalar<int>("Dummy/in", k);
+      tf.stepApplication();
+    }
+  };
+  write(1, 5);
+  tf.writeScalar<uint64_t>("Trigger/capture", 1);
+  tf.stepApplication();
+  // the capture is complete with the second sample after the trigger
+  write(6, 6);
+  BOOST_CHECK(!capture.readNonBlocking());
+  // a trigger during a running capture is ignored
+  tf.writeScalar<uint64_t>("Trigger/capture", 1);
+  tf.stepApplication();
+  write(7, 7);
+  BOOST_CHECK(capture.readNonBlocking());
+  std::vector<int> values(capture.begin(), capture.end()), valuesRef{4, 5, 6, 7};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  auto timeStamps = tf.readArray<uint64_t>("History/Dummy/out_capture_timeStamps");
+  BOOST_CHECK_LE(timeStamps[0], timeStamps[3]);
+  BOOST_CHECK(timeStamps[0] != 0);
+
+  // the frozen capture is not changed by the live history
+  write(8, 8);
+  BOOST_CHECK(!capture.readNonBlocking());
+  BOOST_CHECK_EQUAL(tf.readArray<int>("History/Dummy/out").back(), 8);
+  tf.writeScalar<uint64_t>("Trigger/capture", 1);
+  tf.stepApplication();
+  write(9, 10);
+  BOOST_CHECK(capture.readNonBlocking());
+  values.assign(capture.begin(), capture.end());
+  valuesRef = {7, 8, 9, 10};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+}
+
+BOOST_AUTO_TEST_CASE(testSourceFilter) {
+  std::cout << "testSourceFilter" << std::endl;
+  using ChimeraTK::history::SourceFilter;
+  SourceFilter filter;
+  filter.include("/ADC/channel?").include("/Motor/**").exclude("/ADC/channel7");
+  filter.include("/Cavity[0-9]+/amplitude", SourceFilter::Syntax::regex);
+  BOOST_CHECK(filter.matches("/ADC/channel3"));
+  BOOST_CHECK(!filter.matches("/ADC/channel7"));
+  BOOST_CHECK(!filter.matches("/ADC/channel10"));
+  BOOST_CHECK(filter.matches("/Motor/axis1/position"));
+  BOOST_CHECK(filter.matches("/Cavity12/amplitude"));
+  BOOST_CHECK(!filter.matches("/Cavity/amplitude"));
+  // glob patterns do not treat "." as wildcard and "*" does not cross directories
+  BOOST_CHECK(SourceFilter().include("/a.b/*").matches("/a.b/c"));
+  BOOST_CHECK(!SourceFilter().include("/a.b/*").matches("/aXb/c"));
+  BOOST_CHECK(!SourceFilter().include("/a/*").matches("/a/b/c"));
+  // without include patterns everything not excluded is selected
+  BOOST_CHECK(SourceFilter().exclude("/ADC/**").matches("/Motor/speed"));
+  BOOST_CHECK_THROW(SourceFilter().include("(", SourceFilter::Syntax::regex), ChimeraTK::logic_error);
+
+  // select the device variables in one pass
+  SourceFilter deviceFilter;
+  deviceFilter.include("/Device/sig*").include("/Other/**").exclude("/Device/*64");
+  testAppDev app(deviceFilter);
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  BOOST_CHECK_EQUAL(app.hist.getNumberOfVariables(), 1);
+  tf.writeArray<int>("Dummy/in", {1, 2, 3});
+  tf.stepApplication();
+  BOOST_CHECK_EQUAL(tf.readArray<float>("History/Device/signed32").size(), 20);
+}
+
+BOOST_AUTO_TEST_CASE(testExportMany) {
+  std::cout << "testExportMany" << std::endl;
+  // the export output is created once with the size of all histories
+  testAppMany app(500, "/Trigger/export");
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  auto blob = tf.readArray<uint8_t>("history/export");
+  ChimeraTK::history::HistoryExportHeader header;
+  std::memcpy(&header, blob.data(), sizeof(header));
+  BOOST_CHECK_EQUAL(header.nHistories, 500);
+  // the names like "/Dummy/out123" are padded to 16 bytes, followed by 10 time stamps and 4 int columns of 10 samples
+  size_t sectionSize = sizeof(ChimeraTK::history::HistoryExportSection) + 16 + 10 * 8 + 4 * 40;
+  ChimeraTK::history::HistoryExportSection section;
+  std::memcpy(&section, blob.data() + sizeof(header), sizeof(section));
+  BOOST_CHECK_EQUAL(section.sectionSize, sectionSize);
+  BOOST_CHECK_EQUAL(blob.size(), sizeof(header) + 500 * sectionSize);
+}
+
+BOOST_AUTO_TEST_CASE(testSnapshotSharedMemory) {
+  std::cout << "testSnapshotSharedMemory" << std::endl;
+  saveSnapshot();
+  // the snapshot is shorter than the history
+  auto config = snapshotConfig(6);
+  config.sharedMemoryName = "/ctkHistorySnapshotTest";
+  testAppConfig<Dummy<int>, DummyArray<double>> app(config, {"Dummy", "DummyArray"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  tf.writeScalar<int>("Dummy/in", 6);
+  tf.stepApplication();
+
+  auto fd = shm_open("/ctkHistorySnapshotTest", O_RDONLY, 0);
+  BOOST_REQUIRE(fd >= 0);
+  ChimeraTK::history::SharedHistorySegmentHeader header;
+  BOOST_REQUIRE(read(fd, &header, sizeof(header)) == sizeof(header));
+  auto* segment = static_cast<const char*>(mmap(nullptr, header.segmentSize, PROT_READ, MAP_SHARED, fd, 0));
+  close(fd);
+  BOOST_REQUIRE(segment != MAP_FAILED);
+  auto* position = segment + sizeof(header);
+  for(uint32_t n = 0; n < header.nHistories; n++) {
+    auto* entry = reinterpret_cast<const ChimeraTK::history::SharedHistoryEntryHeader*>(position);
+    std::string name(position + sizeof(*entry), entry->nameLength);
+    if(name == "/Dummy/out") {
+      // the 4 restored samples are the samples 0 to 3, so sample n is in row n % 6
+      BOOST_CHECK_EQUAL(entry->finished.load(std::memory_order_acquire), 5);
+      BOOST_CHECK_EQUAL(entry->started.load(std::memory_order_relaxed), 5);
+      auto* values = reinterpret_cast<const int*>(position + entry->dataOffset);
+      std::vector<int> rows(values, values + 5), rowsRef{2, 3, 4, 5, 6};
+      BOOST_CHECK_EQUAL_COLLECTIONS(rows.begin(), rows.end(), rowsRef.begin(), rowsRef.end());
+    }
+    position += entry->entrySize;
+  }
+  munmap(const_cast<char*>(segment), header.segmentSize);
+  // the published history is consistent with the segment
+  auto values = tf.readArray<int>("History/Dummy/out");
+  std::vector<int> valuesRef{0, 2, 3, 4, 5, 6};
+  BOOST_CHECK_EQUAL_COLLECTIONS(values.begin(), values.end(), valuesRef.begin(), valuesRef.end());
+  std::remove("historySnapshot.bin");
+}
+
+BOOST_AUTO_TEST_CASE(testSnapshotStatistics) {
+  std::cout << "testSnapshotStatistics" << std::endl;
+  saveSnapshot();
+  // only the 4 restored samples are included in the statistics, not the 2 empty rows
+  auto config = snapshotConfig(6);
+  config.enableStatistics = true;
+  testAppConfig<Dummy<int>, DummyArray<double>> app(config, {"Dummy", "DummyArray"});
+  ChimeraTK::TestFacility tf(app);
+  tf.runApplication();
+  BOOST_CHECK_CLOSE(tf.readArray<double>("History/Dummy/out_mean")[0], 3.5, 1e-9);
+  BOOST_CHECK_CLOSE(tf.readArray<double>("History/Dummy/out_rms")[0], std::sqrt((4. + 9. + 16. + 25.) / 4.), 1e-9);
+  BOOST_CHECK_EQUAL(tf.readArray<int>("History/Dummy/out_min")[0], 2);
+  BOOST_CHECK_EQUAL(tf.readArray<int>("History/Dummy/out_max")[0], 5);
+  std::remove("historySnapshot.bin");
+}